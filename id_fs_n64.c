@@ -2,18 +2,36 @@
 
 #include <libdragon.h>
 #include <string.h>
+#include <ctype.h>
 #include <malloc.h>
 #include <fcntl.h>
 #include <system.h>
 #include "id_fs.h"
 
-static const uint32_t SRAM_MAGIC = 0x64646464;
+static const uint32_t SRAM_MAGIC = 0x4F534A31; //'OSJ1', files from before the journal used 0x64646464
 #define SRAMFS_MIN(a,b) (((a)<(b))?(a):(b))
 #define SRAMFS_MAX(a,b) (((a)>(b))?(a):(b))
 
+//Size of the save memory, must match N64_ROM_SAVETYPE in the Makefile
+#ifndef SRAMFS_SIZE
+#define SRAMFS_SIZE (128 * 1024)
+#endif
+
 FS_File FSL_OpenFileInDirCaseInsensitive(const char *dirPath, const char *fileName, bool forWrite)
 {
     char fullFileName[32];
+    if (!forWrite && strncmp(dirPath, "rom:", 4) == 0)
+    {
+        //Game data is read straight off the cartridge into the engine's buffers, see romfs below. Without
+        //a stdio buffer newlib hands each read to romfs whole.
+        sprintf(fullFileName, "cart:/%s", fileName);
+        FS_File fp = fopen(fullFileName, "rb");
+        if (fp != NULL)
+        {
+            setvbuf(fp, NULL, _IONBF, 0);
+            return fp;
+        }
+    }
     sprintf(fullFileName, "%s/%s", dirPath, fileName);
     FS_File fp = fopen(fullFileName, forWrite ? "wb" : "rb");
     return fp;
@@ -34,6 +52,12 @@ bool FSL_IsDirWritable(const char *dirPath)
 
 size_t FS_GetFileSize(FS_File file)
 {
+    //Every filesystem here knows its file sizes, so there's no need to seek to the end and back
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0)
+    {
+        return st.st_size;
+    }
     fseek(file, 0, SEEK_END);
     uint32_t file_length = (uint32_t)ftell(file);
     fseek(file, 0, SEEK_SET);
@@ -50,29 +74,28 @@ typedef struct sram_files_t
 sram_files_t *sram_files = NULL;
 int sram_num_files = 0;
 
-static int sram_get_handle_by_name(const char *name)
+typedef struct
 {
-    for (int i = 1; i <= sram_num_files; i++)
-    {
-        if (strcasecmp(sram_files[i].name, name) == 0)
-        {
-            return i;
-        }
-    }
-    return -1;
-}
-
-static int sram_get_file_start_by_handle(int handle)
+    uint32_t total;     //SRAM managed by sramfs
+    uint32_t allocated; //Given to files, both journal slots of each
+    uint32_t capacity;  //Sum of the largest size each file can grow to
+    uint32_t used;      //Sum of the committed file lengths
+} sramfs_usage_t;
+
+//SRAM is addressed linearly from the start of the PI domain 2 window, but a single DMA mustn't cross one of
+//its 32kB banks. Reads and writes are staged through sram_bounce when the RAM side isn't aligned to the 16
+//byte data cache lines that DMA works in.
+#define SRAM_BANK_SIZE (32 * 1024)
+#define SRAM_BOUNCE_SIZE 4096
+#define SRAM_ALIGN(x) (((x) + 15) & ~15)
+
+static uint8_t __attribute__((aligned(16))) sram_bounce[SRAM_BOUNCE_SIZE];
+
+static unsigned long _sram_address(uint32_t offset)
 {
-    int offset = 0;
-    for (int i = 1; i < handle; i++)
-    {
-        offset += sram_files[i].size;
-    }
-    return offset;
+    return 0x08000000 + (offset & 0x07FFFFFF);
 }
 
-static uint8_t __attribute__((aligned(16))) sector_cache[16];
 static void _dma_read(void * ram_address, unsigned long pi_address, unsigned long len) 
 {
     if (len == 0) return;
@@ -89,95 +112,293 @@ static void _dma_write(void * ram_address, unsigned long pi_address, unsigned lo
     dma_wait();
 }
 
-//Reading and writing to SRAM via DMA must occur from a 16 bytes aligned buffer. For Omnispeak, the save file
-//can be greater than 1 SRAM bank (32kB), so I need to be able to manage access multiple banks contiguously from non aligned buffers at random lengths.
-//I read and write by 16 byte 'sectors' and manage the banking automatically. If a read crosses to a different bank this is handled here.
+//Largest span of whole sectors from aligned_offset that one transfer through the bounce buffer can cover
+//for len bytes starting head bytes in. If the buffer has the same alignment as SRAM only the partial sector
+//is bounced, so the rest can go direct.
+static uint32_t _bounce_span(const uint8_t *buf, uint32_t aligned_offset, uint32_t head, int len)
+{
+    uint32_t bank_end = (aligned_offset | (SRAM_BANK_SIZE - 1)) + 1;
+    uint32_t limit = ((((uintptr_t)buf - head) & 15) == 0) ? 16 : SRAM_BOUNCE_SIZE;
+    return SRAMFS_MIN(SRAMFS_MIN(limit, SRAM_ALIGN(head + len)), bank_end - aligned_offset);
+}
+
+//Aligned buffers are transferred in one DMA per bank, anything else in bounce buffer sized chunks.
+//Partial 16 byte sectors at either end are handled through the bounce buffer too.
 static void read_sram(uint8_t *dst, uint32_t offset, int len)
 {
-    uint32_t aligned_offset;
     while (len > 0)
     {
-        //Make sure we're on a 32bit boundary in a 16 byte sector
-        aligned_offset = offset - (offset % 4);
-        aligned_offset = aligned_offset - (aligned_offset % 16);
-
-        //Read a sector of data from SRAM
-        _dma_read(sector_cache, 0x08000000 + (aligned_offset & 0x07FFFFFF), 16);
+        uint32_t aligned_offset = offset & ~15;
+        uint32_t head = offset - aligned_offset;
+        int n;
+        if (head == 0 && len >= 16 && ((uintptr_t)dst & 15) == 0)
+        {
+            uint32_t bank_end = (offset | (SRAM_BANK_SIZE - 1)) + 1;
+            n = SRAMFS_MIN(len & ~15, bank_end - offset);
+            _dma_read(dst, _sram_address(offset), n);
+        }
+        else
+        {
+            uint32_t span = _bounce_span(dst, aligned_offset, head, len);
+            n = SRAMFS_MIN(len, span - head);
+            _dma_read(sram_bounce, _sram_address(aligned_offset), span);
+            memcpy(dst, sram_bounce + head, n);
+        }
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+}
 
-        //Copy only the required bytes into the dst buffer
-        int br = SRAMFS_MIN(len, 16 - (offset - aligned_offset));
-        memcpy(dst, sector_cache + (offset - aligned_offset), br);
+static void write_sram(const uint8_t *src, uint32_t offset, int len)
+{
+    while (len > 0)
+    {
+        uint32_t aligned_offset = offset & ~15;
+        uint32_t head = offset - aligned_offset;
+        int n;
+        if (head == 0 && len >= 16 && ((uintptr_t)src & 15) == 0)
+        {
+            uint32_t bank_end = (offset | (SRAM_BANK_SIZE - 1)) + 1;
+            n = SRAMFS_MIN(len & ~15, bank_end - offset);
+            _dma_write((void *)src, _sram_address(offset), n);
+        }
+        else
+        {
+            uint32_t span = _bounce_span(src, aligned_offset, head, len);
+            n = SRAMFS_MIN(len, span - head);
+
+            //Read back the sectors that are only partly overwritten
+            uint32_t end = head + n;
+            if (head != 0)
+            {
+                _dma_read(sram_bounce, _sram_address(aligned_offset), 16);
+            }
+            if ((end & 15) != 0 && (head == 0 || end > 16))
+            {
+                _dma_read(sram_bounce + (end & ~15), _sram_address(aligned_offset + (end & ~15)), 16);
+            }
+            memcpy(sram_bounce + head, src, n);
+            _dma_write(sram_bounce, _sram_address(aligned_offset), span);
+        }
+        src += n;
+        offset += n;
+        len -= n;
+    }
+}
 
-        dst += br;
-        offset += br;
-        len -= br;
+//Each file is split into two slots that commits alternate between. A slot starts with a header that is
+//written after the data, so an interrupted commit leaves the previous one intact.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq; //Incremented with every commit, the newest valid slot is the file
+    uint32_t len;
+    uint32_t crc; //CRC-32 of seq, len and the data
+} sram_slot_header_t;
+
+#define SRAM_NUM_SLOTS 2
+#define SRAM_HEADER_SIZE sizeof(sram_slot_header_t)
+
+//Layout is fixed by sramfs_init. Open files are read and written in RAM, and only committed to SRAM when
+//they're closed.
+typedef struct
+{
+    uint32_t start;     //Offset of the first slot in SRAM
+    uint32_t slot_size;
+    uint32_t capacity;  //slot_size less the header
+    uint32_t committed; //Length of the file in the current slot
+    bool failed;      //A write didn't fit, so the file isn't committed on close
+    uint8_t *data;    //16 byte aligned so commits and loads are bulk DMA transfers
+    uint32_t len;
+    uint32_t alloc;
+    bool dirty;
+    bool scanned;     //current and seq have been read from SRAM
+    int current;      //Slot holding the file, -1 if it doesn't exist
+    uint32_t seq;     //Highest sequence number in either slot
+} sram_state_t;
+
+static sram_state_t *sram_state = NULL;
+static int *sram_hash = NULL; //Handles by name hash with linear probing, 0 for an empty bucket
+static uint32_t sram_hash_mask = 0;
+static sram_slot_header_t __attribute__((aligned(16))) sram_header;
+static uint32_t sram_crc_table[256];
+
+static uint32_t _crc32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc = sram_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
     }
+    return ~crc;
 }
 
-static void write_sram(uint8_t *src, uint32_t offset, int len)
+static uint32_t _slot_crc(uint32_t seq, uint32_t len, const uint8_t *data)
 {
-    uint32_t aligned_offset;
-    while (len > 0)
+    uint32_t crc = _crc32(0, (const uint8_t *)&seq, sizeof(seq));
+    crc = _crc32(crc, (const uint8_t *)&len, sizeof(len));
+    return _crc32(crc, data, len);
+}
+
+static uint32_t _name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
     {
-        //Make sure we're on a 32bit boundary in a 16 byte sector
-        aligned_offset = offset - (offset % 4);
-        aligned_offset = aligned_offset - (aligned_offset % 16);
+        hash = (hash ^ (uint8_t)tolower((unsigned char)*name++)) * 16777619u;
+    }
+    return hash;
+}
 
-        //Read a sector of data from SRAM if writing to an unaligned sector
-        //Can skip this read/modify/write if we're aligned and atleast 16 byte.
-        if (len < 16 || (offset - aligned_offset) != 0)
+static int sram_get_handle_by_name(const char *name)
+{
+    for (uint32_t i = _name_hash(name) & sram_hash_mask; sram_hash[i] != 0; i = (i + 1) & sram_hash_mask)
+    {
+        if (strcasecmp(sram_files[sram_hash[i]].name, name) == 0)
         {
-            _dma_read(sector_cache, 0x08000000 + (aligned_offset & 0x07FFFFFF), 16);
+            return sram_hash[i];
         }
+    }
+    return -1;
+}
 
-        int bw = SRAMFS_MIN(len, 16 - (offset - aligned_offset));
-        memcpy(sector_cache + (offset - aligned_offset), src, bw);
-        _dma_write(sector_cache, 0x08000000 + (aligned_offset & 0x07FFFFFF), 16);
+static uint32_t _slot_offset(int handle, int slot)
+{
+    return sram_state[handle].start + slot * sram_state[handle].slot_size;
+}
 
-        src += bw;
-        offset += bw;
-        len -= bw;
+static uint32_t _slot_capacity(int handle)
+{
+    return sram_state[handle].capacity;
+}
+
+static bool _reserve(sram_state_t *st, uint32_t len)
+{
+    if (len <= st->alloc)
+    {
+        return true;
+    }
+    uint32_t alloc = SRAMFS_MAX(SRAM_ALIGN(len), st->alloc * 2);
+    uint8_t *data = memalign(16, alloc);
+    if (data == NULL)
+    {
+        return false;
     }
+    if (st->data != NULL)
+    {
+        memcpy(data, st->data, st->len);
+        free(st->data);
+    }
+    st->data = data;
+    st->alloc = alloc;
+    return true;
 }
 
-static void *__open(char *name, int flags)
+static void _release(sram_state_t *st)
 {
-    name++;
-    int handle = sram_get_handle_by_name(name);
-    if (handle <= 0)
+    free(st->data);
+    st->data = NULL;
+    st->alloc = 0;
+    st->len = 0;
+    st->dirty = false;
+    st->failed = false;
+}
+
+//Loads the newest slot with data matching its checksum into the buffer. Returns false if neither has a commit.
+static bool _load(int handle)
+{
+    sram_state_t *st = &sram_state[handle];
+    sram_slot_header_t headers[SRAM_NUM_SLOTS];
+    bool any = false;
+    for (int slot = 0; slot < SRAM_NUM_SLOTS; slot++)
     {
-        return NULL;
+        read_sram((uint8_t *)&sram_header, _slot_offset(handle, slot), SRAM_HEADER_SIZE);
+        headers[slot] = sram_header;
+        if (sram_header.magic == SRAM_MAGIC && (!any || (int32_t)(sram_header.seq - st->seq) > 0))
+        {
+            st->seq = sram_header.seq;
+            any = true;
+        }
     }
+    st->seq = any ? st->seq : 0;
+    st->scanned = true;
 
-    int offset = sram_get_file_start_by_handle(handle);
-    int magic;
-    read_sram((uint8_t *)&magic, offset, 4);
+    //Newest first
+    int order[SRAM_NUM_SLOTS] = {0, 1};
+    if ((int32_t)(headers[1].seq - headers[0].seq) > 0)
+    {
+        order[0] = 1;
+        order[1] = 0;
+    }
+    for (int i = 0; i < SRAM_NUM_SLOTS; i++)
+    {
+        sram_slot_header_t *h = &headers[order[i]];
+        if (h->magic != SRAM_MAGIC || h->len > _slot_capacity(handle) || !_reserve(st, h->len))
+        {
+            continue;
+        }
+        read_sram(st->data, _slot_offset(handle, order[i]) + SRAM_HEADER_SIZE, h->len);
+        if (_slot_crc(h->seq, h->len, st->data) == h->crc)
+        {
+            st->current = order[i];
+            st->len = h->len;
+            st->committed = h->len;
+            return true;
+        }
+    }
+    st->current = -1;
+    st->len = 0;
+    st->committed = 0;
+    return false;
+}
 
-    //File is meant to be read only, see if it exists by reading the first few bytes
-    //to see if the magic number is present.
-    if (flags == O_RDONLY && magic != SRAM_MAGIC)
+//Writes the buffer to the slot not holding the current commit, then its header
+static void _commit(int handle)
+{
+    sram_state_t *st = &sram_state[handle];
+    int slot = (st->current == 0) ? 1 : 0;
+    uint32_t offset = _slot_offset(handle, slot);
+    write_sram(st->data, offset + SRAM_HEADER_SIZE, st->len);
+
+    sram_header.magic = SRAM_MAGIC;
+    sram_header.seq = st->seq + 1;
+    sram_header.len = st->len;
+    sram_header.crc = _slot_crc(sram_header.seq, st->len, st->data);
+    write_sram((uint8_t *)&sram_header, offset, SRAM_HEADER_SIZE);
+
+    st->current = slot;
+    st->seq = sram_header.seq;
+    st->committed = st->len;
+}
+
+static void *__open(char *name, int flags)
+{
+    name++;
+    int handle = sram_get_handle_by_name(name);
+    if (handle <= 0)
     {
         return NULL;
     }
 
-    //We should 'create' the file
-    if (magic != SRAM_MAGIC)
+    sram_state_t *st = &sram_state[handle];
+    st->len = 0;
+    st->dirty = false;
+    st->failed = false;
+    if (flags & O_TRUNC)
     {
-        //Write the magic number then return handle to the file, then zero the remainder
-        magic = SRAM_MAGIC;
-        write_sram((uint8_t *)&magic, offset, sizeof(SRAM_MAGIC));
-
-        uint8_t zero[16] = {0};
-        int remaining = sram_files[handle].size - sizeof(SRAM_MAGIC);
-        int pos = 0;
-        while(remaining)
+        //Only which slot to commit to is needed, and that doesn't change until the next commit
+        if (!st->scanned)
         {
-            int chunk = SRAMFS_MIN(sizeof(zero), remaining);
-            int index = sizeof(SRAM_MAGIC) + offset + pos;
-            write_sram(zero, index, chunk);
-            remaining -= chunk;
-            pos += chunk;
+            _load(handle);
         }
+        st->len = 0;
+        st->dirty = true;
+    }
+    else if (!_load(handle) && (flags & O_ACCMODE) == O_RDONLY)
+    {
+        _release(st);
+        return NULL;
     }
     sram_files[handle].offset = 0;
     return (void *)handle;
@@ -193,7 +414,7 @@ static int __fstat( void *file, struct stat *st )
     st->st_uid = 0;
     st->st_gid = 0;
     st->st_rdev = 0;
-    st->st_size = sram_files[handle].size;
+    st->st_size = sram_state[handle].len;
     st->st_atime = 0;
     st->st_mtime = 0;
     st->st_ctime = 0;
@@ -217,16 +438,16 @@ static int __lseek(void *file, int ptr, int dir)
     }
     else if (dir == SEEK_END)
     {
-        new_offset = sram_files[handle].size;
+        new_offset = sram_state[handle].len;
     }
 
     if (new_offset < 0)
     {
         new_offset = 0;
     }
-    else if (new_offset > sram_files[handle].size)
+    else if (new_offset > _slot_capacity(handle))
     {
-        new_offset = sram_files[handle].size;
+        new_offset = _slot_capacity(handle);
     }
 
     sram_files[handle].offset = new_offset;
@@ -237,9 +458,10 @@ static int __lseek(void *file, int ptr, int dir)
 static int __read( void *file, uint8_t *ptr, int len )
 {
     int handle = (uint32_t)file;
-    int offset = sram_get_file_start_by_handle(handle) + sram_files[handle].offset + sizeof(SRAM_MAGIC);
-    int max_len = SRAMFS_MIN(len, sram_files[handle].size - offset);
-    read_sram(ptr, offset, max_len);
+    sram_state_t *st = &sram_state[handle];
+    uint32_t offset = sram_files[handle].offset;
+    int max_len = (offset < st->len) ? SRAMFS_MIN(len, st->len - offset) : 0;
+    memcpy(ptr, st->data + offset, max_len);
     sram_files[handle].offset += max_len;
     return max_len;
 }
@@ -247,15 +469,42 @@ static int __read( void *file, uint8_t *ptr, int len )
 static int __write( void *file, uint8_t *ptr, int len )
 {
     int handle = (uint32_t)file;
-    int offset = sram_get_file_start_by_handle(handle) + sram_files[handle].offset + sizeof(SRAM_MAGIC);
-    write_sram(ptr, offset, len);
+    sram_state_t *st = &sram_state[handle];
+    uint32_t offset = sram_files[handle].offset;
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (offset + len > _slot_capacity(handle) || !_reserve(st, offset + len))
+    {
+        //Committing what did fit would replace the last save with a truncated one
+        st->failed = true;
+        return -1;
+    }
+
+    //Anything skipped over by a seek reads back as zero
+    if (offset > st->len)
+    {
+        memset(st->data + st->len, 0, offset - st->len);
+    }
+    memcpy(st->data + offset, ptr, len);
+    st->len = SRAMFS_MAX(st->len, offset + len);
+    st->dirty = true;
     sram_files[handle].offset += len;
     return len;
 }
 
 static int __close( void *file )
 {
-    return 0;
+    int handle = (uint32_t)file;
+    sram_state_t *st = &sram_state[handle];
+    int res = st->failed ? -1 : 0;
+    if (st->dirty && !st->failed)
+    {
+        _commit(handle);
+    }
+    _release(st);
+    return res;
 }
 
 static filesystem_t sram_fs = {
@@ -270,6 +519,109 @@ static filesystem_t sram_fs = {
     0
 };
 
+//Before the journal, OMNISPK.CFG was a magic word followed by its text at the start of SRAM, and SAVEGAM0 the
+//same from 2kB to the end. Files still laid out like that are read into RAM and their magic words cleared
+//before they're committed as the first entries of the new files, so a power cut part way through loses what
+//wasn't committed yet, like an interrupted save does, instead of importing it again from overwritten data.
+#ifdef EP4
+#define SRAM_OLD_SAVE "SAVEGAM0.CK4"
+#elif EP5
+#define SRAM_OLD_SAVE "SAVEGAM0.CK5"
+#elif EP6
+#define SRAM_OLD_SAVE "SAVEGAM0.CK6"
+#endif
+#define SRAM_OLD_MAGIC 0x64646464
+#define SRAM_OLD_FILES 2
+
+static const struct
+{
+    const char *name;
+    uint32_t offset;
+    uint32_t size; //Magic word included
+    bool text;     //Ends at the first NUL, the rest is what the file was created with
+} sram_old_files[SRAM_OLD_FILES] = {
+    {"OMNISPK.CFG", 0, 2048, true},
+    {SRAM_OLD_SAVE, 2048, 128 * 1024 - 2048, false},
+};
+
+static void _import_old(void)
+{
+    int handles[SRAM_OLD_FILES];
+    uint8_t *data[SRAM_OLD_FILES] = {NULL};
+    uint32_t len[SRAM_OLD_FILES];
+    bool found = false;
+    for (int i = 0; i < SRAM_OLD_FILES; i++)
+    {
+        uint32_t magic;
+        read_sram((uint8_t *)&magic, sram_old_files[i].offset, sizeof(magic));
+        handles[i] = sram_get_handle_by_name(sram_old_files[i].name);
+        if (magic != SRAM_OLD_MAGIC)
+        {
+            continue;
+        }
+        found = true;
+        len[i] = sram_old_files[i].size - sizeof(magic);
+        data[i] = memalign(16, SRAM_ALIGN(len[i]));
+        if (handles[i] <= 0 || data[i] == NULL)
+        {
+            debugf("sramfs: %s can't be imported from the old layout\n", sram_old_files[i].name);
+            free(data[i]);
+            data[i] = NULL;
+            continue;
+        }
+        read_sram(data[i], sram_old_files[i].offset + sizeof(magic), len[i]);
+
+        //Files didn't have a length, so the tail of a save is whatever was there before it. Only zeros can be
+        //cut off to fit.
+        uint32_t used = len[i];
+        while (used > 0 && data[i][used - 1] == 0)
+        {
+            used--;
+        }
+        if (sram_old_files[i].text)
+        {
+            len[i] = strnlen((const char *)data[i], len[i]);
+        }
+        else if (used <= _slot_capacity(handles[i]))
+        {
+            len[i] = SRAMFS_MIN(len[i], _slot_capacity(handles[i]));
+        }
+        else
+        {
+            debugf("sramfs: %s is too big to import from the old layout\n", sram_old_files[i].name);
+            free(data[i]);
+            data[i] = NULL;
+        }
+    }
+    if (!found)
+    {
+        return;
+    }
+
+    uint32_t zero = 0;
+    for (int i = 0; i < SRAM_OLD_FILES; i++)
+    {
+        write_sram((uint8_t *)&zero, sram_old_files[i].offset, sizeof(zero));
+    }
+    for (int i = 0; i < SRAM_OLD_FILES; i++)
+    {
+        if (data[i] == NULL)
+        {
+            continue;
+        }
+        sram_state_t *st = &sram_state[handles[i]];
+        _load(handles[i]);
+        _release(st);
+        st->data = data[i];
+        st->alloc = SRAM_ALIGN(len[i]);
+        st->len = len[i];
+        _commit(handles[i]);
+        _release(st);
+        debugf("sramfs: %s imported from the old layout, %lu bytes\n", sram_old_files[i].name,
+               (unsigned long)len[i]);
+    }
+}
+
 int sramfs_init(sram_files_t *files, int num_files)
 {
     assert(files != NULL);
@@ -279,6 +631,368 @@ int sramfs_init(sram_files_t *files, int num_files)
     assert(sram_files != NULL);
     memcpy(&sram_files[1], files, sizeof(sram_files_t) * num_files);
     sram_num_files = num_files;
+
+    sram_state = calloc(num_files + 1, sizeof(sram_state_t));
+    assert(sram_state != NULL);
+
+    //Files without a size share what the others leave. Sizes are rounded down so both slots of every file
+    //start on a 16 byte boundary.
+    uint32_t fixed = 0;
+    int shared = 0;
+    for (int i = 1; i <= num_files; i++)
+    {
+        fixed += sram_files[i].size & ~31;
+        shared += (sram_files[i].size == 0);
+    }
+    assert(fixed <= SRAMFS_SIZE);
+    uint32_t share = shared ? ((SRAMFS_SIZE - fixed) / shared) & ~31 : 0;
+
+    uint32_t start = 0;
+    for (int i = 1; i <= num_files; i++)
+    {
+        sram_files[i].size = (sram_files[i].size == 0) ? share : sram_files[i].size & ~31;
+        assert(sram_files[i].size / SRAM_NUM_SLOTS > SRAM_HEADER_SIZE);
+        sram_state[i].start = start;
+        sram_state[i].slot_size = sram_files[i].size / SRAM_NUM_SLOTS;
+        sram_state[i].capacity = sram_state[i].slot_size - SRAM_HEADER_SIZE;
+        start += sram_files[i].size;
+        debugf("sramfs: %s at 0x%05lx, %lu bytes per commit\n", sram_files[i].name, (unsigned long)sram_state[i].start,
+               (unsigned long)sram_state[i].capacity);
+    }
+
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)num_files * 2)
+    {
+        buckets <<= 1;
+    }
+    sram_hash = calloc(buckets, sizeof(int));
+    assert(sram_hash != NULL);
+    sram_hash_mask = buckets - 1;
+    for (int i = 1; i <= num_files; i++)
+    {
+        uint32_t h = _name_hash(sram_files[i].name) & sram_hash_mask;
+        while (sram_hash[h] != 0)
+        {
+            h = (h + 1) & sram_hash_mask;
+        }
+        sram_hash[h] = i;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+        sram_crc_table[i] = crc;
+    }
+    _import_old();
+
     int res = attach_filesystem("sram:/", &sram_fs);
     return res;
-}
\ No newline at end of file
+}
+
+//Space taken and left in SRAM. The first call for a file that hasn't been opened yet reads it to find how
+//much of it is committed.
+void sramfs_get_usage(sramfs_usage_t *usage)
+{
+    memset(usage, 0, sizeof(sramfs_usage_t));
+    usage->total = SRAMFS_SIZE;
+    for (int i = 1; i <= sram_num_files; i++)
+    {
+        sram_state_t *st = &sram_state[i];
+        if (!st->scanned)
+        {
+            _load(i);
+            _release(st);
+        }
+        usage->allocated += sram_files[i].size;
+        usage->capacity += st->capacity;
+        usage->used += st->committed;
+    }
+}
+
+//Files in the DFS image are contiguous on the cartridge, so once a file's address and length are known any
+//part of it can be DMAed straight to where it's needed. romfs_map looks them up and keeps them, and "cart:/"
+//reads files through them without DFS or a stdio buffer in the way.
+#define ROMFS_MAX_FILES 32
+#define ROMFS_NAME_LEN 16
+
+typedef struct
+{
+    char name[ROMFS_NAME_LEN];
+    uint32_t rom_addr;
+    uint32_t size;
+} romfs_file_t;
+
+typedef struct
+{
+    const romfs_file_t *file;
+    uint32_t offset;
+    uint32_t next;   //Where the last read ended
+} romfs_handle_t;
+
+static romfs_file_t romfs_files[ROMFS_MAX_FILES];
+static int romfs_num_files = 0;
+
+//Sequential reads of a file are read ahead in the background. Once a read starts where the one before it on
+//the same handle ended, what follows it is queued in ROMFS_AHEAD_STEP sized DMAs into a ring of
+//ROMFS_AHEAD_SIZE bytes, and the reads after that are copied out of the ring. The PI works through the steps
+//while the engine does something else with what it read, like expanding it, and romfs_poll() keeps them
+//going from the main loop between reads. A step is short, so any other DMA waits at most one behind it.
+#define ROMFS_AHEAD_SIZE (32 * 1024)
+#define ROMFS_AHEAD_STEP 4096
+
+static uint8_t __attribute__((aligned(16))) romfs_ahead[ROMFS_AHEAD_SIZE];
+static const romfs_file_t *romfs_ahead_file = NULL;
+static uint32_t romfs_ahead_base;     //File offset of the first byte read ahead, at an even PI address
+static uint32_t romfs_ahead_end;      //Bytes past base to read ahead in all, even
+static uint32_t romfs_ahead_queued;   //Bytes past base handed to the PI
+static uint32_t romfs_ahead_arrived;  //Bytes past base that are in the ring
+static uint32_t romfs_ahead_consumed; //Bytes past base that have been read, so their place can be reused
+
+static const romfs_file_t *_romfs_find(const char *name)
+{
+    for (int i = 0; i < romfs_num_files; i++)
+    {
+        if (strcmp(romfs_files[i].name, name) == 0)
+        {
+            return &romfs_files[i];
+        }
+    }
+    if (romfs_num_files == ROMFS_MAX_FILES || strlen(name) >= ROMFS_NAME_LEN)
+    {
+        return NULL;
+    }
+
+    int fd = dfs_open(name);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    int size = dfs_size(fd);
+    dfs_close(fd);
+    uint32_t rom_addr = dfs_rom_addr(name);
+    if (size < 0 || rom_addr == 0)
+    {
+        return NULL;
+    }
+
+    romfs_file_t *file = &romfs_files[romfs_num_files++];
+    strcpy(file->name, name);
+    file->rom_addr = rom_addr;
+    file->size = size;
+    return file;
+}
+
+//PI address and length of a file in the DFS image, which stay valid for as long as the game runs. Any range
+//of it can be read with dma_read(), which takes care of alignment and the data cache.
+bool romfs_map(const char *name, uint32_t *rom_addr, uint32_t *size)
+{
+    const romfs_file_t *file = _romfs_find(name);
+    if (file == NULL)
+    {
+        return false;
+    }
+    *rom_addr = file->rom_addr;
+    *size = file->size;
+    return true;
+}
+
+//Notes a step that has finished and starts the next if there's room for it. A step is done once the PI is
+//idle, as it does one transfer at a time.
+static void _romfs_ahead_step(void)
+{
+    if (romfs_ahead_queued > romfs_ahead_arrived)
+    {
+        if (dma_busy())
+        {
+            return;
+        }
+        romfs_ahead_arrived = romfs_ahead_queued;
+    }
+    uint32_t limit = SRAMFS_MIN(romfs_ahead_end, (romfs_ahead_consumed & ~(ROMFS_AHEAD_STEP - 1)) + ROMFS_AHEAD_SIZE);
+    if (romfs_ahead_queued < limit)
+    {
+        //Steps start on a multiple of their size, so each is in one piece in the ring
+        uint32_t n = SRAMFS_MIN(ROMFS_AHEAD_STEP, limit - romfs_ahead_queued);
+        uint8_t *dst = &romfs_ahead[romfs_ahead_queued % ROMFS_AHEAD_SIZE];
+        data_cache_hit_writeback_invalidate(dst, n);
+        dma_read_raw_async(dst, romfs_ahead_file->rom_addr + romfs_ahead_base + romfs_ahead_queued, n);
+        romfs_ahead_queued += n;
+    }
+}
+
+static void _romfs_ahead_wait(void)
+{
+    if (romfs_ahead_queued > romfs_ahead_arrived)
+    {
+        dma_wait();
+        romfs_ahead_arrived = romfs_ahead_queued;
+    }
+}
+
+static void _romfs_ahead_start(const romfs_file_t *file, uint32_t offset)
+{
+    _romfs_ahead_wait();
+    romfs_ahead_file = file;
+    romfs_ahead_base = offset - ((file->rom_addr + offset) & 1);
+    romfs_ahead_end = (file->size - romfs_ahead_base) & ~1;
+    romfs_ahead_queued = 0;
+    romfs_ahead_arrived = 0;
+    romfs_ahead_consumed = offset - romfs_ahead_base;
+    _romfs_ahead_step();
+}
+
+//Copies as much of a read from the start as the ring has, waiting for the step in flight if it's needed.
+//Returns the number of bytes copied.
+static uint32_t _romfs_ahead_read(const romfs_file_t *file, uint32_t offset, uint8_t *ptr, uint32_t len)
+{
+    if (romfs_ahead_file != file || offset < romfs_ahead_base)
+    {
+        return 0;
+    }
+    uint32_t pos = offset - romfs_ahead_base;
+    if (pos >= romfs_ahead_queued || pos + ROMFS_AHEAD_SIZE < romfs_ahead_queued)
+    {
+        return 0;
+    }
+    if (pos + len > romfs_ahead_arrived)
+    {
+        _romfs_ahead_wait();
+    }
+    uint32_t n = SRAMFS_MIN(len, romfs_ahead_arrived - pos);
+    uint32_t at = pos % ROMFS_AHEAD_SIZE;
+    uint32_t first = SRAMFS_MIN(n, ROMFS_AHEAD_SIZE - at);
+    memcpy(ptr, &romfs_ahead[at], first);
+    memcpy(ptr + first, romfs_ahead, n - first);
+    return n;
+}
+
+//Keeps reading ahead while the engine isn't reading. Called from the main loop.
+void romfs_poll(void)
+{
+    if (romfs_ahead_file != NULL)
+    {
+        _romfs_ahead_step();
+    }
+}
+
+static void *__romfs_open(char *name, int flags)
+{
+    name++;
+    if ((flags & O_ACCMODE) != O_RDONLY)
+    {
+        return NULL;
+    }
+    const romfs_file_t *file = _romfs_find(name);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    romfs_handle_t *handle = malloc(sizeof(romfs_handle_t));
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    handle->file = file;
+    handle->offset = 0;
+    handle->next = 0;
+    return handle;
+}
+
+static int __romfs_fstat(void *file, struct stat *st)
+{
+    romfs_handle_t *handle = file;
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG;
+    st->st_nlink = 1;
+    st->st_size = handle->file->size;
+    return 0;
+}
+
+static int __romfs_lseek(void *file, int ptr, int dir)
+{
+    romfs_handle_t *handle = file;
+    int new_offset = handle->offset;
+
+    if (dir == SEEK_SET)
+    {
+        new_offset = ptr;
+    }
+    else if (dir == SEEK_CUR)
+    {
+        new_offset += ptr;
+    }
+    else if (dir == SEEK_END)
+    {
+        new_offset = handle->file->size + ptr;
+    }
+
+    if (new_offset < 0)
+    {
+        new_offset = 0;
+    }
+    else if (new_offset > handle->file->size)
+    {
+        new_offset = handle->file->size;
+    }
+
+    handle->offset = new_offset;
+    return new_offset;
+}
+
+static int __romfs_read(void *file, uint8_t *ptr, int len)
+{
+    romfs_handle_t *handle = file;
+    int n = SRAMFS_MIN((uint32_t)len, handle->file->size - handle->offset);
+    if (n <= 0)
+    {
+        return n;
+    }
+    bool sequential = (handle->offset == handle->next);
+    uint32_t done = _romfs_ahead_read(handle->file, handle->offset, ptr, n);
+    if (done < n)
+    {
+        dma_read(ptr + done, handle->file->rom_addr + handle->offset + done, n - done);
+    }
+    handle->offset += n;
+    handle->next = handle->offset;
+
+    //Carry on where the ring is if this read was in it, otherwise start again after this one
+    if (romfs_ahead_file == handle->file && handle->offset >= romfs_ahead_base &&
+        handle->offset - romfs_ahead_base <= romfs_ahead_queued && done != 0)
+    {
+        romfs_ahead_consumed = handle->offset - romfs_ahead_base;
+        _romfs_ahead_step();
+    }
+    else if (sequential)
+    {
+        _romfs_ahead_start(handle->file, handle->offset);
+    }
+    return n;
+}
+
+static int __romfs_close(void *file)
+{
+    free(file);
+    return 0;
+}
+
+static filesystem_t rom_fs = {
+    __romfs_open,
+    __romfs_fstat,
+    __romfs_lseek,
+    __romfs_read,
+    0,
+    __romfs_close,
+    0,
+    0,
+    0
+};
+
+//Needs dfs_init first
+int romfs_init(void)
+{
+    return attach_filesystem("cart:/", &rom_fs);
+}
@@ -18,32 +18,603 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <libdragon.h>
 
+#include "id_cfg.h"
 #include "id_in.h"
+#include "id_in_n64_private.h"
 
-static void IN_N64_PumpEvents()
+//libdragon reads the joypads on every retrace and the VI interrupt queues each change of state with the time
+//it was read. IN_N64_PumpEvents drains the queue in order, so a press and release between two pumps still
+//reaches the engine, both as key events and as a button that reads as held until the next pump. With one
+//producer and one consumer the two free running indices are all the locking needed.
+#define IN_QUEUE_EVENTS 64 //Must be a power of two
+#define IN_NUM_PORTS JOYPAD_PORT_COUNT
+
+typedef struct
+{
+    uint32_t ticks; //get_ticks() when it was read
+    uint8_t port;
+    int8_t stick_x, stick_y;
+    uint16_t buttons;
+} in_event_t;
+
+static in_event_t in_queue[IN_QUEUE_EVENTS];
+static volatile uint32_t in_queue_head = 0; //Only written by the VI interrupt
+static volatile uint32_t in_queue_tail = 0; //Only written by IN_N64_PumpEvents
+static uint32_t in_queue_overflows = 0;
+static volatile uint8_t in_connected = 0;   //Bit per port
+
+//Last state queued per port, only used by the VI interrupt
+static uint16_t in_poll_buttons[IN_NUM_PORTS];
+static int8_t in_poll_stick[IN_NUM_PORTS][2];
+
+//State per port as of the last pump. latched has the buttons that went down since the one before, so
+//they read as held for one pump even if they've been let go already.
+static uint16_t in_buttons[IN_NUM_PORTS];
+static uint16_t in_latched[IN_NUM_PORTS];
+static uint16_t in_joy_mask[IN_NUM_PORTS]; //Engine joystick buttons held
+static int in_axes[IN_NUM_PORTS][2]; //Stick after calibration, deadzone and response curve
+
+//Each port has a binding per button. Those are expanded into a table per byte of joypad_buttons_t.raw, so
+//turning the buttons into engine joystick buttons is two lookups. Only the buttons that press a key are
+//looked at one at a time, and only when they change.
+#define IN_NUM_BUTTONS 16
+
+//joypad_buttons_t.raw has A in bit 15 down to C-right in bit 0
+static const char *const in_button_names[IN_NUM_BUTTONS] = {
+    "c_right", "c_left", "c_down", "c_up", "r", "l", "y", "x",
+    "d_right", "d_left", "d_down", "d_up", "start", "z", "b", "a"
+};
+
+static uint32_t in_bindings[IN_NUM_PORTS][IN_NUM_BUTTONS];
+static uint16_t in_joy_table[IN_NUM_PORTS][2][256];
+static uint16_t in_key_buttons[IN_NUM_PORTS];
+
+//The bindings can be changed on the controller too. Holding Z and R together for IN_REMAP_HOLD_MS puts that
+//port in remap mode, where nothing it does reaches the engine, and the next two buttons pressed on it swap
+//their bindings. Pressing the same button twice leaves them as they were.
+#define IN_REMAP_HOLD_MS 2000
+#define IN_REMAP_OFF -2
+#define IN_REMAP_FIRST -1 //Waiting for the first button, after that it's the button
+
+static int8_t in_remap[IN_NUM_PORTS];
+static bool in_remap_held[IN_NUM_PORTS];       //Z and R are down
+static uint32_t in_remap_since[IN_NUM_PORTS];  //get_ticks() when they were both pressed
+static uint16_t in_suppressed[IN_NUM_PORTS];   //Held buttons that do nothing until they're let go
+
+//The stick is scaled by how far it has been seen to go on each axis, which wears down from about 85 on a new
+//controller. Those ranges are learnt as the stick is used and kept in OMNISPK.CFG. The deflection relative to
+//them goes through a radial deadzone and the response curve, which are both in a table built at startup from
+//n64_stick_deadzone (percent of full deflection) and n64_stick_curve (0 for linear to 100 for cubic).
+#define IN_STICK_UNIT 256 //Full deflection after scaling, also the size of the response table
+#define IN_STICK_DEFAULT_RANGE 70
+#define IN_STICK_MIN_RANGE 40
+#define IN_AXIS_MAX 32767
+
+static int in_stick_range[IN_NUM_PORTS][2];
+static uint16_t in_stick_response[IN_STICK_UNIT + 1];
+
+//libdragon reads the joypads on every retrace itself. joypad_poll() doesn't start another read, it takes a copy
+//of the last one for the joypad_get_* calls, and nothing else calls it.
+static void _in_vi_poll(void)
 {
-    joypad_buttons_t keys;
     joypad_poll();
+    uint8_t connected = 0;
+    for (int port = 0; port < IN_NUM_PORTS; port++)
+    {
+        //A controller that's pulled out reads as everything let go, so whatever it held is released
+        joypad_inputs_t inputs = {0};
+        if (joypad_is_connected(port))
+        {
+            connected |= 1 << port;
+            inputs = joypad_get_inputs(port);
+        }
+        uint16_t buttons = inputs.btn.raw;
+        if (buttons == in_poll_buttons[port] && inputs.stick_x == in_poll_stick[port][0] &&
+            inputs.stick_y == in_poll_stick[port][1])
+            continue;
+        //When the queue is full the change is dropped and picked up again on the next retrace
+        uint32_t head = in_queue_head;
+        if (head - in_queue_tail == IN_QUEUE_EVENTS)
+        {
+            in_queue_overflows++;
+            continue;
+        }
+        in_queue[head & (IN_QUEUE_EVENTS - 1)] = (in_event_t){get_ticks(), port, inputs.stick_x, inputs.stick_y, buttons};
+        MEMORY_BARRIER();
+        in_queue_head = head + 1;
+        in_poll_buttons[port] = buttons;
+        in_poll_stick[port][0] = inputs.stick_x;
+        in_poll_stick[port][1] = inputs.stick_y;
+    }
+    in_connected = connected;
+}
+
+#ifdef N64_INPUT_LATENCY
+//Input to photon latency: the time from a button being read down to the first frame shown after the engine
+//saw it, which is the first frame that can react to it. Logged over ISViewer every IN_LATENCY_SAMPLES presses.
+#define IN_LATENCY_SAMPLES 16
+
+static bool in_latency_pending = false;
+static uint32_t in_latency_start;
+static uint32_t in_latency_count = 0;
+static uint64_t in_latency_sum = 0;
+static uint32_t in_latency_max = 0;
+
+//Called by VL_N64_Present with when the frame it showed goes up
+void IN_N64_LatencyFrameShown(uint32_t ticks)
+{
+    if (!in_latency_pending)
+        return;
+    in_latency_pending = false;
+    uint32_t latency = ticks - in_latency_start;
+    in_latency_sum += latency;
+    in_latency_max = latency > in_latency_max ? latency : in_latency_max;
+    if (++in_latency_count == IN_LATENCY_SAMPLES)
+    {
+        debugf("input latency: %d presses, %lu us average, %lu us max\n", IN_LATENCY_SAMPLES,
+               (unsigned long)TIMER_MICROS_LL(in_latency_sum / IN_LATENCY_SAMPLES),
+               (unsigned long)TIMER_MICROS_LL(in_latency_max));
+        in_latency_count = 0;
+        in_latency_sum = 0;
+        in_latency_max = 0;
+    }
+}
+#endif
+
+static const char *_in_range_name(int port, int axis)
+{
+    static char name[32];
+    snprintf(name, sizeof(name), "n64_stick%d_range_%c", port + 1, axis ? 'y' : 'x');
+    return name;
+}
+
+static void _in_stick_init(void)
+{
+    int deadzone = CFG_GetConfigInt("n64_stick_deadzone", 15);
+    int curve = CFG_GetConfigInt("n64_stick_curve", 0);
+    deadzone = deadzone < 0 ? 0 : (deadzone > 90 ? 90 : deadzone);
+    curve = curve < 0 ? 0 : (curve > 100 ? 100 : curve);
+
+    int dz = deadzone * IN_STICK_UNIT / 100;
+    for (int m = 0; m <= IN_STICK_UNIT; m++)
+    {
+        if (m <= dz)
+        {
+            in_stick_response[m] = 0;
+            continue;
+        }
+        //t is how far past the deadzone, 0 to 1 in 16.16. The curve blends t with t cubed.
+        int64_t t = (int64_t)(m - dz) * 65536 / (IN_STICK_UNIT - dz);
+        int64_t t3 = ((t * t) >> 16) * t >> 16;
+        int64_t out = (t * (100 - curve) + t3 * curve) / 100;
+        in_stick_response[m] = (uint16_t)(out * IN_AXIS_MAX >> 16);
+    }
+
+    for (int port = 0; port < IN_NUM_PORTS; port++)
+    {
+        for (int axis = 0; axis < 2; axis++)
+        {
+            int range = CFG_GetConfigInt(_in_range_name(port, axis), IN_STICK_DEFAULT_RANGE);
+            in_stick_range[port][axis] = range < IN_STICK_MIN_RANGE ? IN_STICK_MIN_RANGE : range;
+        }
+    }
+}
+
+static int _in_isqrt(uint32_t v)
+{
+    uint32_t r = 0;
+    for (uint32_t bit = 1u << 30; bit; bit >>= 2)
+    {
+        if (v >= r + bit)
+        {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else
+        {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+//Runs once per stick change, so reading the axes is only a copy
+static void _in_stick(int port, int raw_x, int raw_y)
+{
+    int raw[2] = {raw_x, -raw_y}; //The engine has y going down
+    int v[2];
+    for (int axis = 0; axis < 2; axis++)
+    {
+        int mag = raw[axis] < 0 ? -raw[axis] : raw[axis];
+        if (mag > in_stick_range[port][axis])
+        {
+            in_stick_range[port][axis] = mag;
+            CFG_SetConfigInt(_in_range_name(port, axis), mag);
+        }
+        v[axis] = raw[axis] * IN_STICK_UNIT / in_stick_range[port][axis];
+    }
+
+    int m = _in_isqrt(v[0] * v[0] + v[1] * v[1]);
+    if (m == 0)
+    {
+        in_axes[port][0] = in_axes[port][1] = 0;
+        return;
+    }
+    int out = in_stick_response[m > IN_STICK_UNIT ? IN_STICK_UNIT : m];
+    for (int axis = 0; axis < 2; axis++)
+        in_axes[port][axis] = v[axis] * out / m;
+}
+
+static const char *_in_bind_name(int port, int button)
+{
+    static char name[32];
+    snprintf(name, sizeof(name), "n64_bind%d_%s", port + 1, in_button_names[button]);
+    return name;
+}
+
+static void _in_bind_build(int port)
+{
+    in_key_buttons[port] = 0;
+    for (int button = 0; button < IN_NUM_BUTTONS; button++)
+    {
+        if (IN_N64_BIND_KEY(in_bindings[port][button]))
+            in_key_buttons[port] |= 1 << button;
+    }
+    for (int half = 0; half < 2; half++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            uint16_t mask = 0;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                if (v & (1 << bit))
+                    mask |= IN_N64_BIND_JOY(in_bindings[port][half * 8 + bit]);
+            }
+            in_joy_table[port][half][v] = mask;
+        }
+    }
+}
+
+//Every port starts out the way port 1 always was: A jumps, B pogos, Z and R fire, Start is the menu and Esc,
+//and L and the C buttons are the status box and Enter.
+static void _in_bind_init(void)
+{
+    assert(((joypad_buttons_t){.a = 1}).raw == 0x8000 && ((joypad_buttons_t){.c_right = 1}).raw == 0x0001);
+    uint32_t defaults[IN_NUM_BUTTONS] = {0};
+    joypad_buttons_t b;
+    #define IN_DEFAULT(field, binding) (b.raw = 0, b.field = 1, defaults[__builtin_ctz(b.raw)] = (binding))
+    IN_DEFAULT(a, IN_N64_BIND(1 << IN_joy_jump, 0));
+    IN_DEFAULT(b, IN_N64_BIND(1 << IN_joy_pogo, 0));
+    IN_DEFAULT(z, IN_N64_BIND(1 << IN_joy_fire, 0));
+    IN_DEFAULT(r, IN_N64_BIND(1 << IN_joy_fire, 0));
+    IN_DEFAULT(start, IN_N64_BIND(1 << IN_joy_menu, IN_SC_Escape));
+    IN_DEFAULT(l, IN_N64_BIND(1 << IN_joy_status, IN_SC_Enter));
+    IN_DEFAULT(c_up, IN_N64_BIND(1 << IN_joy_status, IN_SC_Enter));
+    IN_DEFAULT(c_down, IN_N64_BIND(1 << IN_joy_status, IN_SC_Enter));
+    IN_DEFAULT(c_left, IN_N64_BIND(1 << IN_joy_status, IN_SC_Enter));
+    IN_DEFAULT(c_right, IN_N64_BIND(1 << IN_joy_status, IN_SC_Enter));
+    #undef IN_DEFAULT
+
+    for (int port = 0; port < IN_NUM_PORTS; port++)
+    {
+        for (int button = 0; button < IN_NUM_BUTTONS; button++)
+            in_bindings[port][button] = CFG_GetConfigInt(_in_bind_name(port, button), defaults[button]);
+        _in_bind_build(port);
+        in_remap[port] = IN_REMAP_OFF;
+    }
+}
+
+//Also sets it in OMNISPK.CFG, which the engine writes out when it quits
+void IN_N64_SetBinding(int port, int button, uint32_t binding)
+{
+    assert(port >= 0 && port < IN_NUM_PORTS);
+    assert(button >= 0 && button < IN_NUM_BUTTONS);
+    in_bindings[port][button] = binding;
+    CFG_SetConfigInt(_in_bind_name(port, button), binding);
+    _in_bind_build(port);
+}
+
+uint32_t IN_N64_GetBinding(int port, int button)
+{
+    assert(port >= 0 && port < IN_NUM_PORTS);
+    assert(button >= 0 && button < IN_NUM_BUTTONS);
+    return in_bindings[port][button];
+}
+
+//Key presses from buttons that have them
+static void _in_key_events(int port, uint16_t down, uint16_t up)
+{
+    uint16_t changed = (down | up) & in_key_buttons[port];
+    while (changed)
+    {
+        int button = __builtin_ctz(changed);
+        changed &= changed - 1;
+        IN_ScanCode sc = IN_N64_BIND_KEY(in_bindings[port][button]);
+        if (down & (1 << button))
+            IN_HandleKeyDown(sc, 0);
+        else
+            IN_HandleKeyUp(sc, 0);
+    }
+}
+
+static void _in_remap_begin(int port)
+{
+    _in_key_events(port, 0, in_buttons[port] & ~in_suppressed[port]);
+    in_suppressed[port] = 0xFFFF;
+    in_remap[port] = IN_REMAP_FIRST;
+    in_remap_held[port] = false;
+    debugf("input: port %d remapping, press two buttons to swap them\n", port + 1);
+}
+
+//Returns true while the port is remapping, when the buttons don't do anything else
+static bool _in_remap_event(int port, uint16_t buttons, uint16_t down, uint32_t ticks)
+{
+    const uint16_t chord = ((joypad_buttons_t){.z = 1, .r = 1}).raw;
+    if (in_remap[port] == IN_REMAP_OFF)
+    {
+        if ((buttons & chord) != chord)
+        {
+            in_remap_held[port] = false;
+        }
+        else if (down & chord)
+        {
+            in_remap_held[port] = true;
+            in_remap_since[port] = ticks;
+        }
+        return false;
+    }
+
+    while (down)
+    {
+        int button = __builtin_ctz(down);
+        down &= down - 1;
+        if (in_remap[port] == IN_REMAP_FIRST)
+        {
+            in_remap[port] = button;
+            continue;
+        }
+        int first = in_remap[port];
+        if (button != first)
+        {
+            uint32_t binding = in_bindings[port][first];
+            IN_N64_SetBinding(port, first, in_bindings[port][button]);
+            IN_N64_SetBinding(port, button, binding);
+            debugf("input: port %d %s and %s swapped\n", port + 1, in_button_names[first], in_button_names[button]);
+        }
+        //Whatever is still held waits to be let go, so the button just pressed doesn't act on its new binding
+        in_remap[port] = IN_REMAP_OFF;
+        in_suppressed[port] = buttons;
+        break;
+    }
+    return true;
+}
+
+static void _in_event(const in_event_t *ev)
+{
+    int port = ev->port;
+    uint16_t down = ev->buttons & ~in_buttons[port];
+    uint16_t up = in_buttons[port] & ~ev->buttons;
+    in_buttons[port] = ev->buttons;
+    _in_stick(port, ev->stick_x, ev->stick_y);
+    if (_in_remap_event(port, ev->buttons, down, ev->ticks))
+        return;
+
+    up &= ~in_suppressed[port];
+    in_suppressed[port] &= ev->buttons;
+    down &= ~in_suppressed[port];
+    _in_key_events(port, down, up);
+#ifdef N64_INPUT_LATENCY
+    if (down && !in_latency_pending)
+    {
+        in_latency_pending = true;
+        in_latency_start = ev->ticks;
+    }
+#endif
+    in_latched[port] |= down;
+}
+
+#if defined(N64_INPUT_RECORD) && defined(N64_INPUT_REPLAY)
+#error N64_INPUT_RECORD and N64_INPUT_REPLAY are exclusive
+#endif
+
+#if defined(N64_INPUT_RECORD) || defined(N64_INPUT_REPLAY)
+//Input recording for repeatable runs. Every pump is logged over ISViewer as a line with the engine's clock
+//(SDL_t0Service ticks since the first pump) and the joypad changes it took:
+//  inrec <clock> <connected ports> <port>:<buttons>:<stick x>:<stick y> ...
+//after a line with the stick ranges learnt so far. A log, or just those lines out of it, saved as
+//rom:/INPUT.REC is fed back in place of the joypads by a build with N64_INPUT_REPLAY, which also holds
+//the clock to the recording at every pump. As long as the game makes the same pumps, it plays out the same
+//and the frame times can be compared between builds.
+#define IN_REPLAY_FILE "rom:/INPUT.REC"
+#define IN_REPLAY_LINE 1536 //A full queue of changes fits
+
+uint32_t SD_N64_GetT0Count(void);
+void SD_N64_LimitT0(bool limited, uint32_t limit);
+void SD_N64_AudioPoll(void);
+
+static bool in_rec_started = false;
+static uint32_t in_rec_base;  //Clock at the first pump
+static uint32_t in_rec_pumps = 0;
+#endif
 
-    //There's a few joystick buttons that need to be injected as keypresses
-    keys = joypad_get_buttons_pressed(JOYPAD_PORT_1);
-    if (keys.start)   IN_HandleKeyDown(IN_SC_Escape, 0);
-    if (keys.l)       IN_HandleKeyDown(IN_SC_Enter, 0);
-    if (keys.c_up)    IN_HandleKeyDown(IN_SC_Enter, 0);
-    if (keys.c_down)  IN_HandleKeyDown(IN_SC_Enter, 0);
-    if (keys.c_left)  IN_HandleKeyDown(IN_SC_Enter, 0);
-    if (keys.c_right) IN_HandleKeyDown(IN_SC_Enter, 0);
+#ifdef N64_INPUT_RECORD
+//Each pump's line is built up here and logged in one go, so nothing the engine logs meanwhile splits it
+static char in_record_line[IN_REPLAY_LINE];
+static int in_record_len;
 
-    keys = joypad_get_buttons_released(JOYPAD_PORT_1);
-    if (keys.start)   IN_HandleKeyUp(IN_SC_Escape, 0);
-    if (keys.l)       IN_HandleKeyUp(IN_SC_Enter, 0);
-    if (keys.c_up)    IN_HandleKeyUp(IN_SC_Enter, 0);
-    if (keys.c_down)  IN_HandleKeyUp(IN_SC_Enter, 0);
-    if (keys.c_left)  IN_HandleKeyUp(IN_SC_Enter, 0);
-    if (keys.c_right) IN_HandleKeyUp(IN_SC_Enter, 0);
+static void _in_record_begin(void)
+{
+    if (!in_rec_started)
+    {
+        in_rec_started = true;
+        in_rec_base = SD_N64_GetT0Count();
+        in_record_len = snprintf(in_record_line, sizeof(in_record_line), "inrec ranges");
+        for (int port = 0; port < IN_NUM_PORTS; port++)
+        {
+            in_record_len += snprintf(in_record_line + in_record_len, sizeof(in_record_line) - in_record_len,
+                                      " %d %d", in_stick_range[port][0], in_stick_range[port][1]);
+        }
+        debugf("%s\n", in_record_line);
+    }
+    in_record_len = snprintf(in_record_line, sizeof(in_record_line), "inrec %lu %x",
+                             (unsigned long)(SD_N64_GetT0Count() - in_rec_base), in_connected);
+}
+
+static void _in_record_event(const in_event_t *ev)
+{
+    in_record_len += snprintf(in_record_line + in_record_len, sizeof(in_record_line) - in_record_len,
+                              " %x:%x:%d:%d", ev->port, ev->buttons, ev->stick_x, ev->stick_y);
+}
+#endif
+
+#ifdef N64_INPUT_REPLAY
+static FILE *in_replay_file = NULL;
+static char in_replay_line[IN_REPLAY_LINE];
+static const char *in_replay_events;  //Changes for the next pump, in in_replay_line
+static uint32_t in_replay_clock;      //Clock the next pump was recorded at
+static uint8_t in_replay_connected;   //For the next pump
+static uint8_t in_replay_ports;       //Ports connected as of the pump being replayed
+static uint32_t in_replay_start_ticks;
+
+//Reads up to the next pump, skipping the rest of the log
+static bool _in_replay_next(void)
+{
+    while (fgets(in_replay_line, sizeof(in_replay_line), in_replay_file))
+    {
+        unsigned long clock;
+        unsigned connected;
+        int n;
+        if (strncmp(in_replay_line, "inrec ranges", 12) == 0)
+        {
+            const char *p = in_replay_line + 12;
+            for (int port = 0; port < IN_NUM_PORTS; port++)
+            {
+                for (int axis = 0; axis < 2; axis++)
+                {
+                    int range;
+                    if (sscanf(p, " %d%n", &range, &n) == 1)
+                    {
+                        in_stick_range[port][axis] = range;
+                        p += n;
+                    }
+                }
+            }
+        }
+        else if (sscanf(in_replay_line, "inrec %lu %x%n", &clock, &connected, &n) == 2)
+        {
+            in_replay_clock = clock;
+            in_replay_connected = connected;
+            in_replay_events = in_replay_line + n;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _in_replay_init(void)
+{
+    in_replay_file = fopen(IN_REPLAY_FILE, "r");
+    if (in_replay_file == NULL)
+    {
+        debugf("input: no %s to replay\n", IN_REPLAY_FILE);
+        return;
+    }
+    if (!_in_replay_next())
+    {
+        fclose(in_replay_file);
+        in_replay_file = NULL;
+        debugf("input: %s has nothing to replay\n", IN_REPLAY_FILE);
+        return;
+    }
+    in_replay_ports = in_replay_connected;
+}
+
+//Feeds this pump's changes from the recording. False once it's run out and the joypads are live again.
+static bool _in_replay_pump(void)
+{
+    if (in_replay_file == NULL)
+        return false;
+
+    if (!in_rec_started)
+    {
+        in_rec_started = true;
+        in_rec_base = SD_N64_GetT0Count() - in_replay_clock;
+        in_replay_start_ticks = get_ticks();
+    }
+    //The clock was stopped at this pump's count, it can only be behind
+    uint32_t clock = in_rec_base + in_replay_clock;
+    while ((int32_t)(SD_N64_GetT0Count() - clock) < 0)
+        SD_N64_AudioPoll();
+
+    in_replay_ports = in_replay_connected;
+    const char *p = in_replay_events;
+    unsigned port, buttons;
+    int x, y, n;
+    while (sscanf(p, " %x:%x:%d:%d%n", &port, &buttons, &x, &y, &n) == 4)
+    {
+        if (port < IN_NUM_PORTS)
+            _in_event(&(in_event_t){get_ticks(), port, x, y, buttons});
+        p += n;
+    }
+    in_rec_pumps++;
+
+    if (_in_replay_next())
+    {
+        SD_N64_LimitT0(true, in_rec_base + in_replay_clock);
+    }
+    else
+    {
+        SD_N64_LimitT0(false, 0);
+        fclose(in_replay_file);
+        in_replay_file = NULL;
+        debugf("input: replay finished, %lu pumps in %lu ms\n", (unsigned long)in_rec_pumps,
+               (unsigned long)(TIMER_MICROS_LL(get_ticks() - in_replay_start_ticks) / 1000));
+    }
+    //Whatever was read from the joypads meanwhile is dropped
+    in_queue_tail = in_queue_head;
+    return true;
+}
+#endif
+
+static void IN_N64_PumpEvents()
+{
+    memset(in_latched, 0, sizeof(in_latched));
+#ifdef N64_INPUT_REPLAY
+    if (!_in_replay_pump())
+#endif
+    {
+#ifdef N64_INPUT_RECORD
+        _in_record_begin();
+#endif
+        uint32_t head = in_queue_head;
+        MEMORY_BARRIER();
+        while (in_queue_tail != head)
+        {
+            const in_event_t *ev = &in_queue[in_queue_tail & (IN_QUEUE_EVENTS - 1)];
+            _in_event(ev);
+#ifdef N64_INPUT_RECORD
+            _in_record_event(ev);
+#endif
+            MEMORY_BARRIER();
+            in_queue_tail++;
+        }
+#ifdef N64_INPUT_RECORD
+        debugf("%s\n", in_record_line);
+        in_rec_pumps++;
+#endif
+    }
+
+    for (int port = 0; port < IN_NUM_PORTS; port++)
+    {
+        if (in_remap_held[port] && get_ticks() - in_remap_since[port] >= TIMER_TICKS_LL(IN_REMAP_HOLD_MS * 1000))
+            _in_remap_begin(port);
+        uint16_t held = (in_buttons[port] | in_latched[port]) & ~in_suppressed[port];
+        in_joy_mask[port] = in_joy_table[port][0][held & 0xFF] | in_joy_table[port][1][held >> 8];
+    }
 }
 
 static void IN_N64_WaitKey()
@@ -54,11 +625,36 @@ static void IN_N64_WaitKey()
 static void IN_N64_Startup(bool disableJoysticks)
 {
     joypad_init();
+    _in_stick_init();
+    _in_bind_init();
+#ifdef N64_INPUT_REPLAY
+    _in_replay_init();
+#endif
+    register_VI_handler(_in_vi_poll);
     IN_SetControlType(0, IN_ctrl_Joystick1);
     IN_SetJoyConf(IN_joy_jump, 0);
     IN_SetJoyConf(IN_joy_pogo, 1);
     IN_SetJoyConf(IN_joy_fire, 2);
-    IN_SetJoyConf(IN_joy_deadzone, 60);
+    IN_SetJoyConf(IN_joy_deadzone, 0); //The stick has its deadzone applied here already
+}
+
+static void IN_N64_Shutdown()
+{
+    unregister_VI_handler(_in_vi_poll);
+#ifdef N64_INPUT_REPLAY
+    if (in_replay_file != NULL)
+    {
+        SD_N64_LimitT0(false, 0);
+        fclose(in_replay_file);
+        in_replay_file = NULL;
+        debugf("input: replay stopped after %lu pumps\n", (unsigned long)in_rec_pumps);
+    }
+#endif
+#ifdef N64_INPUT_RECORD
+    debugf("input: recorded %lu pumps\n", (unsigned long)in_rec_pumps);
+#endif
+    if (in_queue_overflows)
+        debugf("input: %lu joypad changes dropped with the queue full\n", (unsigned long)in_queue_overflows);
 }
 
 static bool IN_N64_StartJoy(int joystick)
@@ -71,49 +667,44 @@ static void IN_N64_StopJoy(int joystick)
     return;
 }
 
+//The engine's joysticks are the connected ports in order, so a controller keeps working whichever port it's
+//moved to. -1 if there aren't that many.
+static int _in_port_for(int joystick)
+{
+    uint8_t connected = in_connected;
+#ifdef N64_INPUT_REPLAY
+    if (in_replay_file != NULL)
+        connected = in_replay_ports;
+#endif
+    for (int port = 0; port < IN_NUM_PORTS; port++)
+    {
+        if ((connected & (1 << port)) && joystick-- == 0)
+            return port;
+    }
+    return -1;
+}
+
 static bool IN_N64_JoyPresent(int joystick)
 {
-    return joypad_is_connected(joystick);
+    return _in_port_for(joystick) >= 0;
 }
 
 static void IN_N64_JoyGetAbs(int joystick, int *x, int *y)
 {
     int x_val = 0, y_val = 0;
+    int port = _in_port_for(joystick);
 
-    //Map d-pad to analog stick too
-    switch (joypad_get_direction(joystick, JOYPAD_2D_LH))
-    {
-        case JOYPAD_8WAY_RIGHT:
-            x_val = 32767;
-            break;
-        case JOYPAD_8WAY_UP_RIGHT:
-            x_val = 32767;
-            y_val = -32768;
-            break;
-        case JOYPAD_8WAY_UP:
-            y_val = -32768;
-            break;
-        case JOYPAD_8WAY_UP_LEFT:
-            x_val = -32768;
-            y_val = -32768;
-            break;
-        case JOYPAD_8WAY_LEFT:
-            x_val = -32768;
-            break;
-        case JOYPAD_8WAY_DOWN_LEFT:
-            x_val = -32768;
-            y_val = 32767;
-            break;
-        case JOYPAD_8WAY_DOWN:
-            y_val = 32767;
-            break;
-        case JOYPAD_8WAY_DOWN_RIGHT:
-            y_val = 32767;
-            x_val = 32767;
-            break;
-        case JOYPAD_8WAY_NONE:
-        default:
-            break;
+    if (port >= 0)
+    {
+        //The d-pad overrides the stick at full deflection
+        joypad_buttons_t btn = {.raw = in_buttons[port] & ~in_suppressed[port]};
+        x_val = (btn.d_right - btn.d_left) * IN_AXIS_MAX;
+        y_val = (btn.d_down - btn.d_up) * IN_AXIS_MAX;
+        if (x_val == 0 && y_val == 0 && in_remap[port] == IN_REMAP_OFF)
+        {
+            x_val = in_axes[port][0];
+            y_val = in_axes[port][1];
+        }
     }
 
     if (x != NULL)
@@ -128,26 +719,8 @@ static void IN_N64_JoyGetAbs(int joystick, int *x, int *y)
 
 static uint16_t IN_N64_JoyGetButtons(int joystick)
 {
-    uint16_t mask = 0;
-    joypad_inputs_t inputs = joypad_get_inputs(joystick);
-
-    if (IN_N64_JoyPresent(joystick) == false)
-    {
-        return mask;
-    }
-
-    if (inputs.btn.a)       mask |= (1 << IN_joy_jump);
-    if (inputs.btn.b)       mask |= (1 << IN_joy_pogo);
-    if (inputs.btn.start)   mask |= (1 << IN_joy_menu);
-    if (inputs.btn.z)       mask |= (1 << IN_joy_fire);
-    if (inputs.btn.r)       mask |= (1 << IN_joy_fire);
-    if (inputs.btn.l)       mask |= (1 << IN_joy_status);
-    if (inputs.btn.c_up)    mask |= (1 << IN_joy_status);
-    if (inputs.btn.c_down)  mask |= (1 << IN_joy_status);
-    if (inputs.btn.c_left)  mask |= (1 << IN_joy_status);
-    if (inputs.btn.c_right) mask |= (1 << IN_joy_status);
-
-    return mask;
+    int port = _in_port_for(joystick);
+    return port >= 0 ? in_joy_mask[port] : 0;
 }
 
 static const char *IN_N64_JoyGetName(int joystick)
@@ -157,7 +730,7 @@ static const char *IN_N64_JoyGetName(int joystick)
 
 static IN_Backend in_n64_backend = {
     .startup = IN_N64_Startup,
-    .shutdown = 0,
+    .shutdown = IN_N64_Shutdown,
     .pumpEvents = IN_N64_PumpEvents,
     .waitKey = IN_N64_WaitKey,
     .joyStart = IN_N64_StartJoy,
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef ID_IN_N64_PRIVATE_H
+#define ID_IN_N64_PRIVATE_H
+
+#include <stdint.h>
+
+//What a joypad button does: a mask of the engine joystick buttons it holds (the ones IN_SetJoyConf assigns
+//actions to) and optionally a key it presses. Saved in OMNISPK.CFG as n64_bind<port>_<button>.
+#define IN_N64_BIND(joy_mask, scancode) ((uint32_t)(joy_mask) | ((uint32_t)(scancode) << 16))
+#define IN_N64_BIND_JOY(binding) ((uint16_t)((binding) & 0xFFFF))
+#define IN_N64_BIND_KEY(binding) ((uint8_t)((binding) >> 16))
+
+//button is the bit in joypad_buttons_t.raw. Takes effect from the next IN_N64_PumpEvents.
+void IN_N64_SetBinding(int port, int button, uint32_t binding);
+uint32_t IN_N64_GetBinding(int port, int button);
+
+#endif
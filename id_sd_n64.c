@@ -25,56 +25,357 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <math.h>
 #include <libdragon.h>
-#include "opl/dbopl.h"
 
 #include "id_sd.h"
 #include "id_ca.h"
 #include "ck_cross.h"
+#include "n64_prof.h"
+#include "id_sd_n64_private.h"
 
 #define ADLIB_NUM_CHANNELS 1
 #define ADLIB_BYTES_PER_SAMPLE 2
 #define ADLIB_SAMPLE_RATE 11025
 #define ADLIB_MIXER_CHANNEL 0
+#define PCM_MIXER_CHANNEL 1
+#define AUDIO_NUM_BUFFERS 3
+
+//Songs pre-rendered by linux/music_render. Without the file all music is synthesised live.
+#ifdef EP4
+#define PCM_MUSIC_FILE "rom:/MUSICPCM.CK4"
+#elif EP5
+#define PCM_MUSIC_FILE "rom:/MUSICPCM.CK5"
+#elif EP6
+#define PCM_MUSIC_FILE "rom:/MUSICPCM.CK6"
+#endif
+
+//OPL output is synthesised by the t0 timer, a tick's worth of samples before each SDL_t0Service, so register
+//writes land at the right point in the output. music_read drains it from the main thread when the mixer
+//polls. With one producer and one consumer the two free running indices are all the locking needed.
+#define SD_RING_SAMPLES 4096 //Must be a power of two
+#define SD_RING_MAX_FILL 1024 //Anything queued beyond this is dropped to keep the latency down
 
 extern bool sd_musicStarted;
 extern volatile int sd_al_currentSfxLength;
 static waveform_t music;
-static Chip oplChip;
 
 static const int PC_PIT_RATE = 1193182;
 static const int AUDIO_BITRATE = 11025;
 
-static bool SD_N64_IsLocked = false;
+static volatile bool SD_N64_IsLocked = false;
 static bool SD_N64_AudioSubsystem_Up = false;
 
 //Timing backend for the gamelogic which uses the sound system
 static timer_link_t *t0_timer;
+static uint32_t t0_period_us = 0;
+static uint32_t t0_sample_frac = 0;
 void SDL_t0Service(void);
 
+//Samples and SDL_t0Service calls the ticks so far still owe. They build up while the engine holds the lock or
+//music_read is synthesising, and are caught up on the next tick after.
+static uint32_t t0_samples_owed = 0;
+static uint32_t t0_ticks_owed = 0;
+static volatile bool sd_chip_claimed = false; //music_read is synthesising, the t0 timer leaves the chip alone
+
+//Ticks handed to SDL_t0Service, which is the engine's clock. Input replay holds it at the count the recording
+//had by its next pump so the game never runs ahead of it. The sound is still synthesised while it's held.
+static volatile uint32_t t0_count = 0;
+static volatile uint32_t t0_limit = 0;
+static volatile bool t0_limited = false;
+
+static int16_t sd_ring[SD_RING_SAMPLES];
+static volatile uint32_t sd_ring_head = 0; //Only written by the t0 timer
+static volatile uint32_t sd_ring_tail = 0; //Only written by music_read
+static uint32_t sd_ring_underruns = 0;
+
+//While a pre-rendered song streams on PCM_MIXER_CHANNEL the engine still sequences the music, but its writes
+//are kept off the live chip so that only sound effects are synthesised.
+static FILE *pcm_file = NULL;
+static int pcm_num_songs = 0;
+static uint32_t *pcm_song_offset = NULL;
+static uint32_t *pcm_song_len = NULL;
+static waveform_t pcm_music;
+static int pcm_song = -1;
+static volatile bool pcm_playing = false;
+static int pcm_block_index = -1; //Block decoded into pcm_block
+static long pcm_file_pos = -1;
+static uint8_t pcm_raw[SD_N64_PCM_BLOCK_BYTES];
+static int16_t pcm_block[SD_N64_PCM_BLOCK_SAMPLES];
+
+//Only from the t0 timer, or from music_read with the chip claimed
+static void _generate(int16_t *dst, int len)
+{
+    if (!sd_musicStarted && !sd_al_currentSfxLength)
+    {
+        memset(dst, 0, len * ADLIB_NUM_CHANNELS * ADLIB_BYTES_PER_SAMPLE);
+        return;
+    }
+    SD_N64_OplGenerate(dst, len);
+}
+
+static void _ring_produce(int len)
+{
+    uint32_t head = sd_ring_head;
+    len = CK_Cross_min(len, SD_RING_SAMPLES - (int)(head - sd_ring_tail));
+    while (len > 0)
+    {
+        int pos = head & (SD_RING_SAMPLES - 1);
+        int n = CK_Cross_min(len, SD_RING_SAMPLES - pos);
+        _generate(&sd_ring[pos], n);
+        head += n;
+        len -= n;
+    }
+    sd_ring_head = head;
+}
+
 static void music_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking)
 {
     (void)ctx;
     int16_t *dst = CachedAddr(samplebuffer_append(sbuf, wlen));
-    if (sd_musicStarted || sd_al_currentSfxLength)
+    uint32_t tail = sd_ring_tail;
+    uint32_t avail = sd_ring_head - tail;
+    if (avail > SD_RING_MAX_FILL + (uint32_t)wlen)
+    {
+        tail += avail - SD_RING_MAX_FILL - wlen;
+        avail = SD_RING_MAX_FILL + wlen;
+    }
+
+    int copied = 0;
+    while (copied < wlen && avail > 0)
+    {
+        int pos = tail & (SD_RING_SAMPLES - 1);
+        int n = CK_Cross_min(CK_Cross_min(wlen - copied, (int)avail), SD_RING_SAMPLES - pos);
+        memcpy(&dst[copied], &sd_ring[pos], n * ADLIB_BYTES_PER_SAMPLE);
+        copied += n;
+        tail += n;
+        avail -= n;
+    }
+    sd_ring_tail = tail;
+
+    //The timer hasn't kept up (or isn't running yet), make up the rest here. The samples go straight into the
+    //mixer's buffer with interrupts enabled, the timer only holds back its ticks until the chip is handed back.
+    if (copied < wlen)
     {
-        int32_t _data[wlen];
-        Chip__GenerateBlock2(&oplChip, wlen, _data);
-        for (int i = 0; i < wlen; i++)
+        uint32_t late = wlen - copied;
+        sd_chip_claimed = true;
+        MEMORY_BARRIER();
+        _generate(&dst[copied], late);
+        //They're taken off what the ticks owe, so the chip doesn't run ahead of the music
+        disable_interrupts();
+        t0_samples_owed -= CK_Cross_min(t0_samples_owed, late);
+        sd_chip_claimed = false;
+        enable_interrupts();
+        if (t0_period_us)
         {
-            dst[i] = (int16_t)(_data[i]);
+            sd_ring_underruns++;
+#ifdef N64_PROFILE
+            debugf("SD: ring underrun, %d of %d samples generated late (%lu total)\n",
+                   wlen - copied, wlen, (unsigned long)sd_ring_underruns);
+#endif
         }
     }
-    else
+    data_cache_hit_writeback_invalidate(dst, wlen * ADLIB_NUM_CHANNELS * ADLIB_BYTES_PER_SAMPLE);
+}
+
+static uint32_t _rd32be(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint16_t _rd16be(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void _pcm_open(void)
+{
+    uint8_t header[SD_N64_PCM_HEADER_BYTES];
+    pcm_file = fopen(PCM_MUSIC_FILE, "rb");
+    if (pcm_file == NULL)
+    {
+        return;
+    }
+    if (fread(header, 1, sizeof(header), pcm_file) != sizeof(header) ||
+        _rd32be(&header[0]) != SD_N64_PCM_MAGIC || _rd16be(&header[4]) != SD_N64_PCM_VERSION ||
+        _rd16be(&header[6]) != ADLIB_SAMPLE_RATE || _rd16be(&header[8]) != SD_N64_PCM_BLOCK_SAMPLES)
+    {
+        goto fail;
+    }
+
+    pcm_num_songs = _rd16be(&header[10]);
+    pcm_song_offset = malloc(pcm_num_songs * sizeof(uint32_t));
+    pcm_song_len = malloc(pcm_num_songs * sizeof(uint32_t));
+    if (pcm_song_offset == NULL || pcm_song_len == NULL)
+    {
+        goto fail;
+    }
+    for (int i = 0; i < pcm_num_songs; i++)
+    {
+        uint8_t entry[SD_N64_PCM_SONG_BYTES];
+        if (fread(entry, 1, sizeof(entry), pcm_file) != sizeof(entry))
+        {
+            goto fail;
+        }
+        pcm_song_offset[i] = _rd32be(&entry[0]);
+        pcm_song_len[i] = _rd32be(&entry[4]);
+    }
+    pcm_file_pos = -1;
+    return;
+
+fail:
+    debugf("SD: %s is not usable, music will be synthesised\n", PCM_MUSIC_FILE);
+    free(pcm_song_offset);
+    free(pcm_song_len);
+    pcm_song_offset = pcm_song_len = NULL;
+    pcm_num_songs = 0;
+    fclose(pcm_file);
+    pcm_file = NULL;
+}
+
+static void _pcm_load_block(int block)
+{
+    long pos = pcm_song_offset[pcm_song] + (long)block * SD_N64_PCM_BLOCK_BYTES;
+    pcm_block_index = block;
+
+    //Playback is sequential apart from looping, so the seek can nearly always be skipped
+    if (pos != pcm_file_pos && fseek(pcm_file, pos, SEEK_SET) != 0)
+    {
+        pcm_file_pos = -1;
+        memset(pcm_block, 0, sizeof(pcm_block));
+        return;
+    }
+    if (fread(pcm_raw, 1, SD_N64_PCM_BLOCK_BYTES, pcm_file) != SD_N64_PCM_BLOCK_BYTES)
+    {
+        pcm_file_pos = -1;
+        memset(pcm_block, 0, sizeof(pcm_block));
+        return;
+    }
+    pcm_file_pos = pos + SD_N64_PCM_BLOCK_BYTES;
+    SD_N64_AdpcmDecodeBlock(pcm_raw, pcm_block);
+}
+
+static void pcm_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking)
+{
+    (void)ctx;
+    int16_t *dst = CachedAddr(samplebuffer_append(sbuf, wlen));
+    uint32_t len = pcm_song_len[pcm_song];
+    uint32_t pos = (uint32_t)wpos % len;
+
+    //The whole song loops, wrap here too in case the mixer asks past the end
+    int copied = 0;
+    while (copied < wlen)
     {
-        memset(dst, 0, wlen * ADLIB_NUM_CHANNELS * ADLIB_BYTES_PER_SAMPLE);
+        int block = pos / SD_N64_PCM_BLOCK_SAMPLES;
+        int offset = pos % SD_N64_PCM_BLOCK_SAMPLES;
+        if (block != pcm_block_index)
+        {
+            _pcm_load_block(block);
+        }
+        int n = CK_Cross_min(wlen - copied, SD_N64_PCM_BLOCK_SAMPLES - offset);
+        n = CK_Cross_min(n, (int)(len - pos));
+        memcpy(&dst[copied], &pcm_block[offset], n * ADLIB_BYTES_PER_SAMPLE);
+        copied += n;
+        pos += n;
+        if (pos == len)
+        {
+            pos = 0;
+        }
     }
     data_cache_hit_writeback_invalidate(dst, wlen * ADLIB_NUM_CHANNELS * ADLIB_BYTES_PER_SAMPLE);
 }
 
+static void _pcm_stop(void)
+{
+    if (pcm_song < 0)
+    {
+        return;
+    }
+    mixer_ch_stop(PCM_MIXER_CHANNEL);
+    pcm_playing = false;
+    pcm_song = -1;
+}
+
+//Keen's music only uses channels 1-8 and the rhythm register, sound effects only use channel 0
+static bool _is_music_reg(uint8_t reg)
+{
+    if (reg == 0xBD)
+    {
+        return true;
+    }
+    if (reg >= 0xA0 && reg <= 0xC8)
+    {
+        return (reg & 0x0F) != 0;
+    }
+    if (reg >= 0x20 && reg <= 0xF5)
+    {
+        //Operator registers, channel 0 has operators 0 and 3
+        return (reg & 0x1F) != 0 && (reg & 0x1F) != 3;
+    }
+    return false;
+}
+
+//Called from the main thread to hand any free audio buffers to the mixer. The OPL synthesis is done by the
+//t0 timer, so this only copies out of the ring and mixes.
+void SD_N64_AudioPoll(void)
+{
+    N64_PROF_BEGIN(N64_PROF_AUDIO);
+    //The song is restarted through N64_PlayMusic, anything that stops the music stops the stream
+    if (pcm_playing && !sd_musicStarted)
+    {
+        _pcm_stop();
+    }
+    while (audio_can_write())
+    {
+        short *buf = audio_write_begin();
+        mixer_poll(buf, audio_get_buffer_length());
+        audio_write_end();
+    }
+    N64_PROF_END();
+}
+
 //Audio interrupts
 static void _t0service(int ovfl)
 {
-    SDL_t0Service();
+    t0_sample_frac += ADLIB_SAMPLE_RATE * t0_period_us;
+    t0_samples_owed += t0_sample_frac / 1000000;
+    t0_sample_frac %= 1000000;
+    t0_ticks_owed++;
+    if (sd_chip_claimed)
+    {
+        return;
+    }
+    //Synthesise the samples covering the ticks just gone, before the game writes the next registers
+    _ring_produce(t0_samples_owed);
+    t0_samples_owed = 0;
+    if (SD_N64_IsLocked)
+    {
+        return;
+    }
+    while (t0_ticks_owed > 0)
+    {
+        if (t0_limited && t0_count == t0_limit)
+        {
+            t0_ticks_owed = 0;
+            break;
+        }
+        t0_ticks_owed--;
+        t0_count++;
+        SDL_t0Service();
+    }
+}
+
+uint32_t SD_N64_GetT0Count(void)
+{
+    return t0_count;
+}
+
+//The clock stops once it reaches limit, until it's raised or limited is false
+void SD_N64_LimitT0(bool limited, uint32_t limit)
+{
+    //The t0 timer must never see one without the other
+    disable_interrupts();
+    t0_limit = limit;
+    t0_limited = limited;
+    enable_interrupts();
 }
 
 static void SD_N64_SetTimer0(int16_t int_8_divisor)
@@ -82,12 +383,21 @@ static void SD_N64_SetTimer0(int16_t int_8_divisor)
     //Create an interrupt that occurs at a certain frequency.
     uint16_t ints_per_sec = PC_PIT_RATE / int_8_divisor;
     stop_timer(t0_timer);
-    start_timer(t0_timer, TIMER_TICKS(1000000 / ints_per_sec), TF_CONTINUOUS, _t0service);
+    t0_period_us = 1000000 / ints_per_sec;
+    start_timer(t0_timer, TIMER_TICKS(t0_period_us), TF_CONTINUOUS, _t0service);
 }
 
+//The music is sequenced from the t0 timer, but sound effects are started from the main thread. The chip is
+//synthesised from the t0 timer too, so those writes must not land in the middle of it.
 static void SD_N64_alOut(uint8_t reg, uint8_t val)
 {
-    Chip__WriteReg(&oplChip, reg, val);
+    if (pcm_playing && _is_music_reg(reg))
+    {
+        return;
+    }
+    disable_interrupts();
+    SD_N64_OplWrite(reg, val);
+    enable_interrupts();
 }
 
 static void SD_N64_PCSpkOn(bool on, int freq)
@@ -101,14 +411,12 @@ static void SD_N64_Startup(void)
         return;
     }
 
-    audio_init(AUDIO_BITRATE, 2);
-    mixer_init(1);
+    audio_init(AUDIO_BITRATE, AUDIO_NUM_BUFFERS);
+    mixer_init(2);
     t0_timer = new_timer(0, TF_DISABLED, _t0service);
 
     //Init adlib engine for music
-    DBOPL_InitTables();
-    Chip__Chip(&oplChip);
-    Chip__Setup(&oplChip, ADLIB_SAMPLE_RATE);
+    SD_N64_OplInit(ADLIB_SAMPLE_RATE);
 
     music.bits = ADLIB_BYTES_PER_SAMPLE * 8;
     music.channels = ADLIB_NUM_CHANNELS;
@@ -118,6 +426,13 @@ static void SD_N64_Startup(void)
     music.loop_len = 0;
     music.ctx = (void *)&music;
     mixer_ch_play(ADLIB_MIXER_CHANNEL, &music);
+
+    _pcm_open();
+    pcm_music.bits = ADLIB_BYTES_PER_SAMPLE * 8;
+    pcm_music.channels = ADLIB_NUM_CHANNELS;
+    pcm_music.frequency = ADLIB_SAMPLE_RATE;
+    pcm_music.read = pcm_read;
+    pcm_music.ctx = (void *)&pcm_music;
     SD_N64_AudioSubsystem_Up = true;
 }
 
@@ -127,7 +442,13 @@ static void SD_N64_Shutdown(void)
     {
         return;
     }
+    _pcm_stop();
     audio_close();
+    if (pcm_file != NULL)
+    {
+        fclose(pcm_file);
+        pcm_file = NULL;
+    }
     SD_N64_AudioSubsystem_Up = false;
 }
 
@@ -137,7 +458,9 @@ static void SD_N64_Lock()
     {
         return;
     }
+    //The t0 timer keeps synthesising, but holds back SDL_t0Service while the engine changes the sound state
     SD_N64_IsLocked = true;
+    MEMORY_BARRIER();
 }
 
 static void SD_N64_Unlock()
@@ -146,6 +469,7 @@ static void SD_N64_Unlock()
     {
         return;
     }
+    MEMORY_BARRIER();
     SD_N64_IsLocked = false;
 }
 
@@ -153,8 +477,30 @@ void N64_LoadSound(int16_t sound)
 {
 }
 
+//Called as the engine starts sequencing a song. If it was pre-rendered, stream it instead of synthesising it.
 void N64_PlayMusic(int16_t song)
 {
+    _pcm_stop();
+    if (pcm_file == NULL || song < 0 || song >= pcm_num_songs || pcm_song_len[song] == 0)
+    {
+        return;
+    }
+
+    pcm_song = song;
+    pcm_block_index = -1;
+    pcm_music.len = pcm_song_len[song];
+    pcm_music.loop_len = pcm_song_len[song];
+
+    //Notes the live chip was already playing on the music channels won't see their key off any more
+    disable_interrupts();
+    for (int ch = 1; ch < 9; ch++)
+    {
+        SD_N64_OplWrite(0xB0 + ch, 0);
+    }
+    SD_N64_OplWrite(0xBD, 0);
+    pcm_playing = true;
+    enable_interrupts();
+    mixer_ch_play(PCM_MIXER_CHANNEL, &pcm_music);
 }
 
 void N64_PlaySound(int16_t sound)
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// IMA ADPCM for the pre-rendered music. Every block starts with the decoder state so it can be decoded on
+// its own, which is all the streaming needs to seek and loop. The encoder is only used by the host tool.
+
+#include <stdint.h>
+#include "id_sd_n64_private.h"
+
+static const int16_t adpcm_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+    107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+    796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026,
+    4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+    20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t adpcm_index_step[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+//Applies one code to the state, shared by both directions so the encoder tracks the decoder exactly
+static int16_t _adpcm_step(SD_N64_AdpcmState *state, uint8_t code)
+{
+    int step = adpcm_steps[state->index];
+    int diff = step >> 3;
+    if (code & 4)
+        diff += step;
+    if (code & 2)
+        diff += step >> 1;
+    if (code & 1)
+        diff += step >> 2;
+
+    int predictor = state->predictor + ((code & 8) ? -diff : diff);
+    predictor = (predictor < INT16_MIN) ? INT16_MIN : (predictor > INT16_MAX) ? INT16_MAX : predictor;
+    state->predictor = (int16_t)predictor;
+
+    int index = state->index + adpcm_index_step[code];
+    state->index = (index < 0) ? 0 : (index > 88) ? 88 : index;
+    return state->predictor;
+}
+
+void SD_N64_AdpcmEncodeBlock(SD_N64_AdpcmState *state, const int16_t *src, uint8_t *dst)
+{
+    dst[0] = (uint8_t)(state->predictor >> 8);
+    dst[1] = (uint8_t)state->predictor;
+    dst[2] = state->index;
+    dst[3] = 0;
+    dst += 4;
+
+    for (int i = 0; i < SD_N64_PCM_BLOCK_SAMPLES; i++)
+    {
+        int step = adpcm_steps[state->index];
+        int delta = src[i] - state->predictor;
+        uint8_t code = 0;
+        if (delta < 0)
+        {
+            code = 8;
+            delta = -delta;
+        }
+        if (delta >= step)
+        {
+            code |= 4;
+            delta -= step;
+        }
+        if (delta >= step >> 1)
+        {
+            code |= 2;
+            delta -= step >> 1;
+        }
+        if (delta >= step >> 2)
+        {
+            code |= 1;
+        }
+        _adpcm_step(state, code);
+
+        if (i & 1)
+            dst[i >> 1] |= code;
+        else
+            dst[i >> 1] = code << 4;
+    }
+}
+
+void SD_N64_AdpcmDecodeBlock(const uint8_t *src, int16_t *dst)
+{
+    SD_N64_AdpcmState state;
+    state.predictor = (int16_t)((src[0] << 8) | src[1]);
+    state.index = (src[2] > 88) ? 88 : src[2];
+    src += 4;
+
+    for (int i = 0; i < SD_N64_PCM_BLOCK_SAMPLES; i += 2)
+    {
+        dst[i] = _adpcm_step(&state, src[i >> 1] >> 4);
+        dst[i + 1] = _adpcm_step(&state, src[i >> 1] & 0x0F);
+    }
+}
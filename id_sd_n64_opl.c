@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// OPL2 synthesis for the single mono stream this port plays. DBOPL already skips silent channels
+// inside a block; this skips calling it at all once the chip has gone quiet, and narrows its
+// 32-bit output to saturated 16-bit samples in fixed size blocks.
+
+#include <stdint.h>
+#include <string.h>
+#include "opl/dbopl.h"
+#include "id_sd_n64_private.h"
+
+static Chip opl_chip;
+static int32_t opl_block[SD_N64_OPL_BLOCK];
+static uint16_t opl_keys;      //Bit per melodic channel keyed on, rhythm instruments from bit 9
+static uint8_t opl_regBD;
+static int opl_quiet_samples;  //Silent output since the last register write
+static int opl_idle_samples;
+static bool opl_idle;
+static SD_N64_OplStats opl_stats;
+
+void SD_N64_OplInit(int sample_rate)
+{
+    DBOPL_InitTables();
+    Chip__Chip(&opl_chip);
+    Chip__Setup(&opl_chip, sample_rate);
+    opl_keys = 0;
+    opl_regBD = 0;
+    opl_quiet_samples = 0;
+    opl_idle_samples = sample_rate * SD_N64_OPL_IDLE_MS / 1000;
+    opl_idle = true;
+    memset(&opl_stats, 0, sizeof(opl_stats));
+}
+
+void SD_N64_OplWrite(uint8_t reg, uint8_t val)
+{
+    Chip__WriteReg(&opl_chip, reg, val);
+    if (reg >= 0xB0 && reg <= 0xB8)
+    {
+        uint16_t bit = 1 << (reg - 0xB0);
+        opl_keys = (val & 0x20) ? (opl_keys | bit) : (opl_keys & ~bit);
+    }
+    else if (reg == 0xBD)
+    {
+        opl_regBD = val;
+    }
+
+    //Any write can make a released voice audible again (a level change for one), so start counting again
+    opl_quiet_samples = 0;
+    opl_idle = false;
+}
+
+static uint16_t _keys_down(void)
+{
+    //BD, SD, TT, CY and HH keys only count in rhythm mode
+    return opl_keys | ((opl_regBD & 0x20) ? (uint16_t)(opl_regBD & 0x1F) << 9 : 0);
+}
+
+void SD_N64_OplGenerate(int16_t *dst, int len)
+{
+    while (len > 0)
+    {
+        if (opl_idle)
+        {
+            memset(dst, 0, len * sizeof(int16_t));
+            opl_stats.skipped += len;
+            return;
+        }
+
+        int n = (len < SD_N64_OPL_BLOCK) ? len : SD_N64_OPL_BLOCK;
+        Chip__GenerateBlock2(&opl_chip, n, opl_block);
+
+        int32_t any = 0;
+        for (int i = 0; i < n; i++)
+        {
+            int32_t s = opl_block[i];
+            if (s != (int16_t)s)
+            {
+                s = (s < 0) ? INT16_MIN : INT16_MAX;
+                opl_stats.clipped++;
+            }
+            dst[i] = (int16_t)s;
+            any |= s;
+        }
+        opl_stats.generated += n;
+
+        if (any == 0 && _keys_down() == 0)
+        {
+            opl_quiet_samples += n;
+            opl_idle = (opl_quiet_samples >= opl_idle_samples);
+        }
+        else
+        {
+            opl_quiet_samples = 0;
+        }
+        dst += n;
+        len -= n;
+    }
+}
+
+bool SD_N64_OplIdle(void)
+{
+    return opl_idle;
+}
+
+void SD_N64_OplGetStats(SD_N64_OplStats *stats)
+{
+    *stats = opl_stats;
+}
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef ID_SD_N64_PRIVATE_H
+#define ID_SD_N64_PRIVATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//Samples generated per call into DBOPL, and the size of the intermediate buffer it writes to
+#define SD_N64_OPL_BLOCK 64
+
+//The chip counts as idle once every key is off and its output has been silent this long
+#ifndef SD_N64_OPL_IDLE_MS
+#define SD_N64_OPL_IDLE_MS 100
+#endif
+
+typedef struct
+{
+    uint32_t generated; //Samples synthesised by DBOPL
+    uint32_t skipped;   //Samples written as silence while the chip was idle
+    uint32_t clipped;   //Samples that had to be saturated to fit in 16 bits
+} SD_N64_OplStats;
+
+void SD_N64_OplInit(int sample_rate);
+void SD_N64_OplWrite(uint8_t reg, uint8_t val);
+void SD_N64_OplGenerate(int16_t *dst, int len);
+bool SD_N64_OplIdle(void);
+void SD_N64_OplGetStats(SD_N64_OplStats *stats);
+
+//Music pre-rendered at build time by linux/music_render and streamed from rom:/ by id_sd_n64.c.
+//All fields are big endian:
+//  header: 'OPCM', u16 version, u16 sample rate, u16 samples per block, u16 number of songs
+//  songs:  u32 file offset of the first block, u32 length in samples, for each song
+//  blocks: s16 predictor, u8 step index, u8 unused, then the samples as IMA ADPCM, high nibble first
+#define SD_N64_PCM_MAGIC 0x4F50434D
+#define SD_N64_PCM_VERSION 1
+#define SD_N64_PCM_HEADER_BYTES 12
+#define SD_N64_PCM_SONG_BYTES 8
+#define SD_N64_PCM_BLOCK_SAMPLES 256
+#define SD_N64_PCM_BLOCK_BYTES (4 + SD_N64_PCM_BLOCK_SAMPLES / 2)
+
+typedef struct
+{
+    int16_t predictor;
+    uint8_t index;
+} SD_N64_AdpcmState;
+
+void SD_N64_AdpcmEncodeBlock(SD_N64_AdpcmState *state, const int16_t *src, uint8_t *dst);
+void SD_N64_AdpcmDecodeBlock(const uint8_t *src, int16_t *dst);
+
+#endif
@@ -8,32 +8,888 @@
 
 #include "id_vl.h"
 #include "id_vl_private.h"
+#include "id_vl_n64_private.h"
 #include "ck_cross.h"
+#include "n64_prof.h"
 
-typedef struct VL_N64_Surface
+//Masked sprite blits to the front buffer are not drawn into its pixels. They are queued and drawn by the
+//RDP over the surface in VL_N64_Present. Each queued sprite keeps the parts of its rectangle that haven't
+//been overwritten since, so the refresh manager erasing it by redrawing tiles just trims or removes it.
+//Anything that reads those pixels or draws over them with a mask bakes the sprite in with the CPU first.
+#define SPRITE_QUEUE_MAX 128
+#define SPRITE_MAX_PIECES 8
+
+typedef struct
+{
+    int x0, y0, x1, y1;
+} n64_rect_t;
+
+//Regions of the front buffer written since they were last shown. One list collects everything since the last
+//Present (for the data cache writeback) and each display buffer keeps its own list, since with multiple display
+//buffers a region has to be redrawn into every buffer that hasn't seen it yet. A list that overflows collapses
+//to its bounding box, and a buffer whose damage covers more than DIRTY_FULL_PERCENT of the screen is redrawn whole.
+#define DIRTY_RECTS_MAX 32
+#define DIRTY_FULL_PERCENT 60
+#define MAX_DISPLAY_BUFFERS 3
+
+typedef struct
 {
-    VL_SurfaceUsage use;
-    int width, height;
-    uint8_t *pixels;
-} VL_N64_Surface;
+    bool full;
+    int num;
+    n64_rect_t rects[DIRTY_RECTS_MAX];
+} dirty_list_t;
+
+typedef struct
+{
+    surface_t *fb;
+    int scrlX, scrlY;
+    dirty_list_t dirty;
+    uint32_t border; //Colour the border was last filled with, 0 before it has been
+} display_buffer_t;
+
+static dirty_list_t frame_dirty;
+static display_buffer_t display_buffers[MAX_DISPLAY_BUFFERS];
+
+typedef struct
+{
+    VL_N64_Gfx *spr;
+    int x, y;
+    int num_pieces;
+    n64_rect_t pieces[SPRITE_MAX_PIECES];
+} queued_sprite_t;
+
+static VL_N64_Surface *front_surface = NULL;
+static queued_sprite_t sprite_queue[SPRITE_QUEUE_MAX];
+static int sprite_queue_len = 0;
+
+//Unmasked 16x16 tiles drawn to the front buffer on its tile grid aren't written into its pixels either. Each
+//cell of the grid keeps the converted tile last drawn there, and VL_N64_Present draws the cells in the area it
+//redraws with the RDP, straight from the tile textures in the conversion cache. A tile is converted and written
+//back to RDRAM once, and an animated tile changing frame only changes which texture its cell points at.
+//Like the sprites, a cell is baked into the pixels first when something reads it or draws over part of it.
+#ifndef VL_N64_TILE_LAYER
+#define VL_N64_TILE_LAYER 1
+#endif
+#define TILE_SIZE 16
+
+//Indexed by where the pixels are stored, so the cells stay put when the surface scrolls. NULL when the front
+//buffer isn't a whole number of tiles.
+static VL_N64_Gfx **tile_cells = NULL;
+static int tile_cells_w;
+static int tile_cells_used = 0;
+
+//The EGA overscan border is drawn around the game view, VL_N64_BORDER pixels wide, by the RDP in each display
+//buffer when it's shown and the colour has changed since that buffer last had it. 0 fills the screen with the view.
+#ifndef VL_N64_BORDER
+#define VL_N64_BORDER 8
+#endif
 
 static surface_t *disp;
-static uint32_t display_width;
+static uint32_t display_width; //Of the game view, the framebuffer also has the border
 static uint32_t display_height;
 static uint32_t border_colour = 0xFFFFFFFF;
 
-uint16_t *palette;
-uint8_t pal_slot = 1;
+//RGBA5551 of every EGA colour value, converted from VL_EGARGBColorTable the first time it's used. Converted
+//colours have the alpha bit set, so 0 marks one that hasn't been yet.
+static uint16_t ega_rgba5551[256];
+
+//The palettes the engine set most recently, each ready to be loaded as the TLUT. Fades step through the same
+//few palettes every time, so after the first one a palette change is only a lookup here. CI8 textures can't
+//pick a TLUT bank the way CI4 ones can, so the TLUT in TMEM is still reloaded, but straight from the cache.
+#define PALETTE_CACHE_SIZE 8
+#define PALETTE_TLUT_STRIDE 32 //Entries per cached TLUT, keeping each one 64 byte aligned
+
+typedef struct
+{
+    uint8_t ega[16];
+    uint16_t *tlut;
+    uint32_t last_used;
+    bool valid;
+} palette_cache_t;
+
+static palette_cache_t palette_cache[PALETTE_CACHE_SIZE];
+static uint16_t *palette_tluts = NULL;
+static uint32_t palette_uses = 0;
+static uint16_t *palette = NULL; //TLUT of the current palette, in palette_tluts
 static bool palette_dirty = false;
 
-static void _do_audio_update()
+//The mixer runs on the main thread, so it's fed once per frame and while waiting. See id_sd_n64.c.
+void SD_N64_AudioPoll(void);
+//Reading ahead from the cartridge carries on from the main loop too. See id_fs_n64.c.
+void romfs_poll(void);
+#ifdef N64_INPUT_LATENCY
+//Ends an input latency measurement with when the frame goes up. See id_in_n64.c.
+void IN_N64_LatencyFrameShown(uint32_t ticks);
+#endif
+
+static bool _rect_overlaps(const n64_rect_t *a, const n64_rect_t *b)
 {
-    if (audio_can_write())
+    return a->x0 < b->x1 && b->x0 < a->x1 && a->y0 < b->y1 && b->y0 < a->y1;
+}
+
+static int _rect_area(const n64_rect_t *r)
+{
+    return (r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+static n64_rect_t _rect_union(const n64_rect_t *a, const n64_rect_t *b)
+{
+    n64_rect_t u = {
+        CK_Cross_min(a->x0, b->x0),
+        CK_Cross_min(a->y0, b->y0),
+        CK_Cross_max(a->x1, b->x1),
+        CK_Cross_max(a->y1, b->y1)
+    };
+    return u;
+}
+
+static void _dirty_add(dirty_list_t *d, n64_rect_t r)
+{
+    if (d->full)
+        return;
+
+    //Merge with any rect that the union doesn't grow much beyond the two areas, then retry with the result
+    for (int i = 0; i < d->num; i++)
     {
-        short *buf = audio_write_begin();
-        mixer_poll(buf, audio_get_buffer_length());
-        audio_write_end();
+        n64_rect_t u = _rect_union(&d->rects[i], &r);
+        if (_rect_area(&u) <= _rect_area(&d->rects[i]) + _rect_area(&r) + 64)
+        {
+            d->rects[i] = d->rects[--d->num];
+            r = u;
+            i = -1;
+        }
     }
+
+    if (d->num == DIRTY_RECTS_MAX)
+    {
+        for (int i = 0; i < d->num; i++)
+            r = _rect_union(&d->rects[i], &r);
+        d->num = 0;
+    }
+    d->rects[d->num++] = r;
+}
+
+static void _dirty_clear(dirty_list_t *d)
+{
+    d->full = false;
+    d->num = 0;
+}
+
+static void _dirty_set_full(dirty_list_t *d)
+{
+    d->full = true;
+    d->num = 0;
+}
+
+static bool _clip_rect(const VL_N64_Surface *surf, int x, int y, int w, int h, n64_rect_t *r)
+{
+    r->x0 = CK_Cross_max(x, 0);
+    r->y0 = CK_Cross_max(y, 0);
+    r->x1 = CK_Cross_min(x + w, surf->width);
+    r->y1 = CK_Cross_min(y + h, surf->height);
+    return r->x0 < r->x1 && r->y0 < r->y1;
+}
+
+//Where a column or row of a surface is stored. The coordinate must be inside the surface.
+static inline int _wrap_x(const VL_N64_Surface *surf, int x)
+{
+    x += surf->ox;
+    return (x >= surf->width) ? x - surf->width : x;
+}
+
+static inline int _wrap_y(const VL_N64_Surface *surf, int y)
+{
+    y += surf->oy;
+    return (y >= surf->height) ? y - surf->height : y;
+}
+
+static inline uint8_t *_pixel_ptr(const VL_N64_Surface *surf, int x, int y)
+{
+    return surf->pixels + _wrap_y(surf, y) * surf->width + _wrap_x(surf, x);
+}
+
+//Splits a rectangle inside a surface at the wrap seams into the pieces that are contiguous in memory.
+//Returns the number of pieces written to out (1 to 4).
+static int _wrap_split(const VL_N64_Surface *surf, const n64_rect_t *r, n64_rect_t *out)
+{
+    int seam_x = surf->width - surf->ox;
+    int seam_y = surf->height - surf->oy;
+    int xs[3] = {r->x0, r->x1, r->x1}, nx = 1;
+    int ys[3] = {r->y0, r->y1, r->y1}, ny = 1;
+    if (r->x0 < seam_x && seam_x < r->x1)
+    {
+        xs[1] = seam_x;
+        nx = 2;
+    }
+    if (r->y0 < seam_y && seam_y < r->y1)
+    {
+        ys[1] = seam_y;
+        ny = 2;
+    }
+    int n = 0;
+    for (int j = 0; j < ny; j++)
+    {
+        for (int i = 0; i < nx; i++)
+            out[n++] = (n64_rect_t){xs[i], ys[j], xs[i + 1], ys[j + 1]};
+    }
+    return n;
+}
+
+//Record that a region of a surface has changed. Only the front buffer is tracked. The display buffers keep
+//surface coordinates, the writeback list keeps where the pixels are stored.
+static void _mark_dirty(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    if (surf != front_surface)
+        return;
+    n64_rect_t r;
+    if (!_clip_rect(surf, x, y, w, h, &r))
+        return;
+    n64_rect_t pieces[4];
+    int n = _wrap_split(surf, &r, pieces);
+    for (int i = 0; i < n; i++)
+    {
+        int px = _wrap_x(surf, pieces[i].x0), py = _wrap_y(surf, pieces[i].y0);
+        _dirty_add(&frame_dirty, (n64_rect_t){px, py, px + pieces[i].x1 - pieces[i].x0, py + pieces[i].y1 - pieces[i].y0});
+    }
+    for (int i = 0; i < MAX_DISPLAY_BUFFERS; i++)
+    {
+        if (display_buffers[i].fb)
+            _dirty_add(&display_buffers[i].dirty, r);
+    }
+}
+
+static void _mark_all_dirty(void)
+{
+    _dirty_set_full(&frame_dirty);
+    for (int i = 0; i < MAX_DISPLAY_BUFFERS; i++)
+        _dirty_set_full(&display_buffers[i].dirty);
+}
+
+static display_buffer_t *_display_buffer_for(surface_t *fb)
+{
+    for (int i = 0; i < MAX_DISPLAY_BUFFERS; i++)
+    {
+        if (display_buffers[i].fb == fb)
+            return &display_buffers[i];
+    }
+    //First time this buffer is shown, it needs everything
+    for (int i = 0; i < MAX_DISPLAY_BUFFERS; i++)
+    {
+        if (display_buffers[i].fb == NULL)
+        {
+            display_buffers[i].fb = fb;
+            _dirty_set_full(&display_buffers[i].dirty);
+            return &display_buffers[i];
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+//Writes the parts of p not covered by r into out. Returns the number of rectangles written (0 to 4).
+static int _rect_subtract(const n64_rect_t *p, const n64_rect_t *r, n64_rect_t *out)
+{
+    if (!_rect_overlaps(p, r))
+    {
+        out[0] = *p;
+        return 1;
+    }
+
+    int n = 0;
+    int y0 = CK_Cross_max(p->y0, r->y0);
+    int y1 = CK_Cross_min(p->y1, r->y1);
+    if (p->y0 < r->y0)
+        out[n++] = (n64_rect_t){p->x0, p->y0, p->x1, r->y0};
+    if (r->y1 < p->y1)
+        out[n++] = (n64_rect_t){p->x0, r->y1, p->x1, p->y1};
+    if (p->x0 < r->x0)
+        out[n++] = (n64_rect_t){p->x0, y0, r->x0, y1};
+    if (r->x1 < p->x1)
+        out[n++] = (n64_rect_t){r->x1, y0, p->x1, y1};
+    return n;
+}
+
+//Somewhere for the generic PAL8 converters to draw a rectangle of a surface. If the rectangle is inside the
+//surface and doesn't cross a wrap seam they draw straight into the pixels, otherwise into a scratch buffer
+//that is filled from the surface first and copied back around the seams after.
+typedef struct
+{
+    VL_N64_Surface *surf;
+    n64_rect_t r;
+    uint8_t *pixels; //Where r.x0, r.y0 is
+    int pitch;
+    bool scratch;
+} draw_target_t;
+
+static uint8_t *scratch_buf = NULL;
+static int scratch_size = 0;
+
+static void _scratch_reserve(int size)
+{
+    if (size <= scratch_size)
+        return;
+    free(scratch_buf);
+    scratch_buf = (uint8_t *)malloc(size);
+    assert(scratch_buf != NULL);
+    scratch_size = size;
+}
+
+//Copies between the scratch buffer and the part of t->r inside the surface.
+static void _target_copy(draw_target_t *t, bool to_surface)
+{
+    n64_rect_t c, pieces[4];
+    if (!_clip_rect(t->surf, t->r.x0, t->r.y0, t->r.x1 - t->r.x0, t->r.y1 - t->r.y0, &c))
+        return;
+    int n = _wrap_split(t->surf, &c, pieces);
+    for (int i = 0; i < n; i++)
+    {
+        n64_rect_t *p = &pieces[i];
+        for (int y = p->y0; y < p->y1; y++)
+        {
+            uint8_t *s = _pixel_ptr(t->surf, p->x0, y);
+            uint8_t *b = t->pixels + (y - t->r.y0) * t->pitch + (p->x0 - t->r.x0);
+            if (to_surface)
+                memcpy(s, b, p->x1 - p->x0);
+            else
+                memcpy(b, s, p->x1 - p->x0);
+        }
+    }
+}
+
+static void _target_begin(draw_target_t *t, VL_N64_Surface *surf, n64_rect_t r)
+{
+    n64_rect_t pieces[4];
+    t->surf = surf;
+    t->r = r;
+    t->scratch = r.x0 < 0 || r.y0 < 0 || r.x1 > surf->width || r.y1 > surf->height || _wrap_split(surf, &r, pieces) > 1;
+    if (!t->scratch)
+    {
+        t->pixels = _pixel_ptr(surf, r.x0, r.y0);
+        t->pitch = surf->width;
+        return;
+    }
+    t->pitch = r.x1 - r.x0;
+    _scratch_reserve(t->pitch * (r.y1 - r.y0));
+    t->pixels = scratch_buf;
+    _target_copy(t, false);
+}
+
+static void _target_end(draw_target_t *t)
+{
+    if (t->scratch)
+        _target_copy(t, true);
+}
+
+//Draws a converted graphic clipped to the surface
+static void _gfx_to_surface(VL_N64_Gfx *gfx, VL_N64_Surface *surf, int x, int y, int colour)
+{
+    VL_N64_GfxCacheWait(gfx);
+    n64_rect_t r;
+    if (!_clip_rect(surf, x, y, gfx->width, gfx->height, &r))
+        return;
+    draw_target_t t;
+    _target_begin(&t, surf, r);
+    VL_N64_GfxToPAL8(gfx, t.pixels, x - r.x0, y - r.y0, t.pitch, r.x1 - r.x0, r.y1 - r.y0, colour);
+    _target_end(&t);
+}
+
+#if VL_N64_SWAR
+//Bits from the start of one row of an engine 1bpp graphic to the next, rows start on a byte
+static int _1bpp_pitch(int w)
+{
+    return (w + 7) / 8 * 8;
+}
+#endif
+
+//Copies one row, in pieces wherever either surface wraps. Both rows must be inside their surfaces.
+static void _copy_row(VL_N64_Surface *dest, int x, int y, VL_N64_Surface *src, int sx, int sy, int w)
+{
+    uint8_t *drow = dest->pixels + _wrap_y(dest, y) * dest->width;
+    const uint8_t *srow = src->pixels + _wrap_y(src, sy) * src->width;
+    while (w > 0)
+    {
+        int dx = _wrap_x(dest, x), ssx = _wrap_x(src, sx);
+        int n = CK_Cross_min(w, CK_Cross_min(dest->width - dx, src->width - ssx));
+        memcpy(drow + dx, srow + ssx, n);
+        x += n;
+        sx += n;
+        w -= n;
+    }
+}
+
+//Calls fn for each cell with a tile that overlaps r, a rectangle inside the front buffer. part is the overlap
+//where the pixels are stored and x, y is its top left on the surface.
+typedef void (*tile_cell_fn)(int cell, const n64_rect_t *part, int x, int y, void *arg);
+
+static void _tiles_for_each(const n64_rect_t *r, tile_cell_fn fn, void *arg)
+{
+    if (tile_cells_used == 0)
+        return;
+    n64_rect_t pieces[4];
+    int n = _wrap_split(front_surface, r, pieces);
+    for (int i = 0; i < n; i++)
+    {
+        n64_rect_t *p = &pieces[i];
+        int dx = _wrap_x(front_surface, p->x0) - p->x0, dy = _wrap_y(front_surface, p->y0) - p->y0;
+        for (int cy = (p->y0 + dy) / TILE_SIZE; cy * TILE_SIZE < p->y1 + dy; cy++)
+        {
+            for (int cx = (p->x0 + dx) / TILE_SIZE; cx * TILE_SIZE < p->x1 + dx; cx++)
+            {
+                int cell = cy * tile_cells_w + cx;
+                if (tile_cells[cell] == NULL)
+                    continue;
+                n64_rect_t part = {
+                    CK_Cross_max(cx * TILE_SIZE, p->x0 + dx),
+                    CK_Cross_max(cy * TILE_SIZE, p->y0 + dy),
+                    CK_Cross_min((cx + 1) * TILE_SIZE, p->x1 + dx),
+                    CK_Cross_min((cy + 1) * TILE_SIZE, p->y1 + dy)
+                };
+                fn(cell, &part, part.x0 - dx, part.y0 - dy, arg);
+            }
+        }
+    }
+}
+
+static void _tile_drop(int cell, const n64_rect_t *part, int x, int y, void *arg)
+{
+    VL_N64_GfxCacheRelease(tile_cells[cell]);
+    tile_cells[cell] = NULL;
+    tile_cells_used--;
+}
+
+static void _tile_bake(int cell, const n64_rect_t *part, int x, int y, void *arg)
+{
+    const uint8_t *in = tile_cells[cell]->pixels;
+    int px = cell % tile_cells_w * TILE_SIZE, py = cell / tile_cells_w * TILE_SIZE;
+    uint8_t *out = front_surface->pixels + py * front_surface->width + px;
+    for (int i = 0; i < TILE_SIZE; i++, in += TILE_SIZE, out += front_surface->width)
+        memcpy(out, in, TILE_SIZE);
+    //The display buffers already show these pixels, they only need writing back for the next redraw
+    _dirty_add(&frame_dirty, (n64_rect_t){px, py, px + TILE_SIZE, py + TILE_SIZE});
+    _tile_drop(cell, part, x, y, arg);
+}
+
+static void _tile_occlude(int cell, const n64_rect_t *part, int x, int y, void *arg)
+{
+    if (_rect_area(part) == TILE_SIZE * TILE_SIZE)
+        _tile_drop(cell, part, x, y, arg);
+    else
+        _tile_bake(cell, part, x, y, arg);
+}
+
+static void _tile_draw(int cell, const n64_rect_t *part, int x, int y, void *arg)
+{
+    const int *scrl = (const int *)arg;
+    surface_t tex = {
+        .buffer = tile_cells[cell]->tex,
+        .height = TILE_SIZE,
+        .width = TILE_SIZE,
+        .stride = TILE_SIZE,
+        .flags = FMT_CI8
+    };
+    rdpq_blitparms_t parms = {
+        .s0 = part->x0 % TILE_SIZE,
+        .t0 = part->y0 % TILE_SIZE,
+        .width = part->x1 - part->x0,
+        .height = part->y1 - part->y0
+    };
+    rdpq_tex_blit(&tex, x - scrl[0], y - scrl[1], &parms);
+}
+
+static void _tiles_bake_region(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    n64_rect_t r;
+    if (surf == front_surface && _clip_rect(surf, x, y, w, h, &r))
+        _tiles_for_each(&r, _tile_bake, NULL);
+}
+
+//Cells entirely inside the region are dropped, ones partly inside are baked
+static void _tiles_occlude(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    n64_rect_t r;
+    if (surf == front_surface && _clip_rect(surf, x, y, w, h, &r))
+        _tiles_for_each(&r, _tile_occlude, NULL);
+}
+
+//Puts an unmasked graphic in the tile layer instead of the pixels if it's a tile on the grid. Its rectangle
+//must have been occluded already.
+static bool _tiles_place(VL_N64_Surface *surf, VL_N64_Gfx *gfx, int x, int y)
+{
+    if (surf != front_surface || tile_cells == NULL || gfx->width != TILE_SIZE || gfx->height != TILE_SIZE)
+        return false;
+    if (x < 0 || y < 0 || x + TILE_SIZE > surf->width || y + TILE_SIZE > surf->height)
+        return false;
+    int px = _wrap_x(surf, x), py = _wrap_y(surf, y);
+    if ((px | py) % TILE_SIZE != 0 || !VL_N64_GfxCacheAcquireTex(gfx))
+        return false;
+    int cell = py / TILE_SIZE * tile_cells_w + px / TILE_SIZE;
+    assert(tile_cells[cell] == NULL);
+    tile_cells[cell] = gfx;
+    tile_cells_used++;
+    return true;
+}
+
+static void _tiles_bake_all(void)
+{
+    if (front_surface)
+        _tiles_bake_region(front_surface, 0, 0, front_surface->width, front_surface->height);
+}
+
+static void _sprite_remove(int index)
+{
+    VL_N64_GfxCacheRelease(sprite_queue[index].spr);
+    sprite_queue_len--;
+    memmove(&sprite_queue[index], &sprite_queue[index + 1], (sprite_queue_len - index) * sizeof(queued_sprite_t));
+}
+
+//Draw queued sprites 0..last into the surface pixels on the CPU, oldest first, and drop them from the queue.
+static void _sprites_bake_until(int last)
+{
+    for (int i = 0; i <= last; i++)
+    {
+        queued_sprite_t *q = &sprite_queue[i];
+        for (int p = 0; p < q->num_pieces; p++)
+        {
+            n64_rect_t wrapped[4];
+            n64_rect_t *piece = &q->pieces[p];
+            _tiles_bake_region(front_surface, piece->x0, piece->y0, piece->x1 - piece->x0, piece->y1 - piece->y0);
+            int n = _wrap_split(front_surface, piece, wrapped);
+            for (int j = 0; j < n; j++)
+            {
+                n64_rect_t *r = &wrapped[j];
+                for (int y = r->y0; y < r->y1; y++)
+                {
+                    const uint8_t *in = q->spr->tex + (y - q->y) * q->spr->width + (r->x0 - q->x);
+                    uint8_t *out = _pixel_ptr(front_surface, r->x0, y);
+                    for (int x = r->x0; x < r->x1; x++, in++, out++)
+                    {
+                        if (*in != VL_N64_TRANSPARENT_INDEX)
+                            *out = *in;
+                    }
+                }
+            }
+            n64_rect_t *r = &q->pieces[p];
+            _mark_dirty(front_surface, r->x0, r->y0, r->x1 - r->x0, r->y1 - r->y0);
+        }
+        VL_N64_GfxCacheRelease(q->spr);
+    }
+    sprite_queue_len -= last + 1;
+    memmove(&sprite_queue[0], &sprite_queue[last + 1], sprite_queue_len * sizeof(queued_sprite_t));
+}
+
+//Bakes the queued sprites that overlap a region, and everything queued before them to keep the draw order.
+static void _sprites_bake_region(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    if (surf != front_surface)
+        return;
+    n64_rect_t r = {x, y, x + w, y + h};
+    int last = -1;
+    for (int i = 0; i < sprite_queue_len; i++)
+    {
+        for (int p = 0; p < sprite_queue[i].num_pieces; p++)
+        {
+            if (_rect_overlaps(&sprite_queue[i].pieces[p], &r))
+            {
+                last = i;
+                break;
+            }
+        }
+    }
+    if (last >= 0)
+        _sprites_bake_until(last);
+}
+
+//Trims the queued sprites to the parts outside a region.
+static void _sprites_occlude(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    if (surf != front_surface)
+        return;
+    n64_rect_t r = {x, y, x + w, y + h};
+    n64_rect_t pieces[SPRITE_MAX_PIECES * 4];
+    int i = 0;
+    while (i < sprite_queue_len)
+    {
+        queued_sprite_t *q = &sprite_queue[i];
+        int n = 0;
+        for (int p = 0; p < q->num_pieces; p++)
+        {
+            n += _rect_subtract(&q->pieces[p], &r, &pieces[n]);
+        }
+        if (n > SPRITE_MAX_PIECES)
+        {
+            //Too fragmented, give up on this one. Everything before it is baked too to keep the draw order.
+            _sprites_bake_until(i);
+            i = 0;
+            continue;
+        }
+        if (n == 0)
+        {
+            _sprite_remove(i);
+            continue;
+        }
+        memcpy(q->pieces, pieces, n * sizeof(n64_rect_t));
+        q->num_pieces = n;
+        i++;
+    }
+}
+
+//Call before the CPU reads a region of a surface, or draws to it with a mask.
+static void _layers_bake_region(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    _sprites_bake_region(surf, x, y, w, h);
+    _tiles_bake_region(surf, x, y, w, h);
+}
+
+//Call before the CPU overwrites every pixel in a region of a surface.
+static void _layers_occlude(VL_N64_Surface *surf, int x, int y, int w, int h)
+{
+    _tiles_occlude(surf, x, y, w, h);
+    _sprites_occlude(surf, x, y, w, h);
+}
+
+static void _sprites_queue(VL_N64_Gfx *spr, int x, int y)
+{
+    n64_rect_t r = {
+        CK_Cross_max(x, 0),
+        CK_Cross_max(y, 0),
+        CK_Cross_min(x + spr->width, front_surface->width),
+        CK_Cross_min(y + spr->height, front_surface->height)
+    };
+    if (r.x0 >= r.x1 || r.y0 >= r.y1)
+    {
+        VL_N64_GfxCacheRelease(spr);
+        return;
+    }
+    if (sprite_queue_len == SPRITE_QUEUE_MAX)
+    {
+        _sprites_bake_until(sprite_queue_len - 1);
+    }
+    queued_sprite_t *q = &sprite_queue[sprite_queue_len++];
+    q->spr = spr;
+    q->x = x;
+    q->y = y;
+    q->num_pieces = 1;
+    q->pieces[0] = r;
+}
+
+//The front buffer contents moved by -dx, -dy. Queued sprites move with them. Anything pushed over an edge
+//wraps around to the opposite one, which a queued sprite can't do, so those are baked in first.
+static void _sprites_scroll(int dx, int dy)
+{
+    n64_rect_t keep = {
+        CK_Cross_max(dx, 0),
+        CK_Cross_max(dy, 0),
+        front_surface->width + CK_Cross_min(dx, 0),
+        front_surface->height + CK_Cross_min(dy, 0)
+    };
+    int last = -1;
+    for (int i = 0; i < sprite_queue_len; i++)
+    {
+        for (int p = 0; p < sprite_queue[i].num_pieces; p++)
+        {
+            n64_rect_t *r = &sprite_queue[i].pieces[p];
+            if (r->x0 < keep.x0 || r->y0 < keep.y0 || r->x1 > keep.x1 || r->y1 > keep.y1)
+            {
+                last = i;
+                break;
+            }
+        }
+    }
+    if (last >= 0)
+        _sprites_bake_until(last);
+
+    for (int i = 0; i < sprite_queue_len; i++)
+    {
+        queued_sprite_t *q = &sprite_queue[i];
+        q->x -= dx;
+        q->y -= dy;
+        for (int p = 0; p < q->num_pieces; p++)
+        {
+            q->pieces[p].x0 -= dx;
+            q->pieces[p].x1 -= dx;
+            q->pieces[p].y0 -= dy;
+            q->pieces[p].y1 -= dy;
+        }
+    }
+}
+
+//Draws a rectangle of a surface to the screen, with one blit per piece either side of the wrap seams.
+static void _surface_blit(const surface_t *tex, const VL_N64_Surface *surf, const n64_rect_t *r, int scrlX, int scrlY)
+{
+    n64_rect_t pieces[4];
+    int n = _wrap_split(surf, r, pieces);
+    for (int i = 0; i < n; i++)
+    {
+        n64_rect_t *p = &pieces[i];
+        rdpq_blitparms_t parms = {
+            .s0 = _wrap_x(surf, p->x0),
+            .t0 = _wrap_y(surf, p->y0),
+            .width = p->x1 - p->x0,
+            .height = p->y1 - p->y0
+        };
+        rdpq_tex_blit(tex, p->x0 - scrlX, p->y0 - scrlY, &parms);
+    }
+}
+
+//The sprites are only in this display buffer, so their area is marked for redraw the next time it is shown.
+static void _sprites_draw(display_buffer_t *buf, int scrlX, int scrlY)
+{
+    rdpq_mode_alphacompare(1);
+    for (int i = 0; i < sprite_queue_len; i++)
+    {
+        queued_sprite_t *q = &sprite_queue[i];
+        surface_t tex = {
+            .buffer = q->spr->tex,
+            .height = q->spr->height,
+            .width = q->spr->width,
+            .stride = q->spr->width,
+            .flags = FMT_CI8
+        };
+        for (int p = 0; p < q->num_pieces; p++)
+        {
+            n64_rect_t *r = &q->pieces[p];
+            rdpq_blitparms_t parms = {
+                .s0 = r->x0 - q->x,
+                .t0 = r->y0 - q->y,
+                .width = r->x1 - r->x0,
+                .height = r->y1 - r->y0
+            };
+            rdpq_tex_blit(&tex, r->x0 - scrlX, r->y0 - scrlY, &parms);
+            _dirty_add(&buf->dirty, *r);
+        }
+    }
+    rdpq_mode_alphacompare(0);
+}
+
+//Frames are paced on the VI interrupt, which counts retraces: 60 a second on NTSC consoles and 50 on PAL ones.
+//Each frame is shown a whole number of retraces after the last one. That interval goes up when the game's
+//frames take longer than it and back down once they fit in one less with some room to spare, so the frames
+//come out evenly spaced instead of alternating between short and long. With three display buffers the game
+//starts on the next frame while the RDP is still drawing the last one. Waiting for a retrace or a display
+//buffer feeds the mixer and keeps the cartridge read-ahead going in id_fs_n64.c. Otherwise it spins: the game
+//runs without libdragon's threads so there's nothing to yield to, and the VR4300 can't sleep until an interrupt.
+#ifndef VL_N64_DISPLAY_BUFFERS
+#define VL_N64_DISPLAY_BUFFERS 3
+#endif
+#if VL_N64_DISPLAY_BUFFERS > MAX_DISPLAY_BUFFERS
+#error VL_N64_DISPLAY_BUFFERS is more than the MAX_DISPLAY_BUFFERS tracked
+#endif
+#ifndef VL_N64_FRAME_PACING
+#define VL_N64_FRAME_PACING 1
+#endif
+#define FRAME_INTERVAL_MAX 4
+
+typedef struct
+{
+    uint32_t shown;
+    uint32_t late;         //Shown more retraces after the last frame than the interval
+    uint32_t buffer_waits; //Had to wait for a display buffer to be free
+    uint32_t max_vis;      //Most retraces between two frames
+} frame_stats_t;
+
+static volatile uint32_t vi_count = 0;
+static volatile uint32_t vi_last_ticks; //get_ticks() at the last retrace
+static bool vi_running = false;
+static long long vi_ticks;           //Timer ticks per retrace
+static uint32_t frame_shown_vi;      //Retrace the last frame went up on
+static long long frame_start_ticks;  //When the game started on the current frame
+static long long frame_work_avg = 0; //Timer ticks the game spends on a frame, smoothed
+static int frame_interval = 1;
+static frame_stats_t frame_stats;
+
+static void _vi_handler(void)
+{
+    vi_last_ticks = get_ticks();
+    vi_count++;
+}
+
+static void _frame_idle(void)
+{
+    SD_N64_AudioPoll();
+    romfs_poll();
+}
+
+//Waits until vi_count reaches vi. Before the VI handler is running, retraces are timed instead.
+static void _vi_wait_until(uint32_t vi)
+{
+    if (!vi_running)
+    {
+        long long until = timer_ticks() + (long long)(int32_t)(vi - vi_count) * TIMER_TICKS_LL(1000000LL / 60);
+        while (timer_ticks() < until)
+            _frame_idle();
+        vi_count = vi;
+        return;
+    }
+    while ((int32_t)(vi - vi_count) > 0)
+        _frame_idle();
+}
+
+static void _frame_start(void)
+{
+    vi_ticks = TICKS_PER_SECOND / (get_tv_type() == TV_TYPE_PAL ? 50 : 60);
+    register_VI_handler(_vi_handler);
+    vi_running = true;
+    frame_shown_vi = vi_count;
+    frame_start_ticks = timer_ticks();
+    frame_work_avg = 0;
+    frame_interval = 1;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+}
+
+static void _frame_stop(void)
+{
+    unregister_VI_handler(_vi_handler);
+    vi_running = false;
+}
+
+static void _frame_log_stats(void)
+{
+    debugf("frames: %lu shown, %lu late, %lu waited for a buffer, at most %lu retraces apart, interval %d\n",
+           (unsigned long)frame_stats.shown, (unsigned long)frame_stats.late, (unsigned long)frame_stats.buffer_waits,
+           (unsigned long)frame_stats.max_vis, frame_interval);
+}
+
+//A display buffer to draw the next frame into, waiting for one to be shown if they're all queued. NULL if
+//there's no video mode.
+static surface_t *_frame_get_buffer(void)
+{
+    surface_t *fb = display_try_get();
+    if (fb == NULL && vi_running)
+    {
+        frame_stats.buffer_waits++;
+        while ((fb = display_try_get()) == NULL)
+            _frame_idle();
+    }
+    return fb;
+}
+
+//Call once the frame has been drawn and just before it's shown
+static void _frame_pace(void)
+{
+    long long work = timer_ticks() - frame_start_ticks;
+    frame_work_avg += (work - frame_work_avg) / 8;
+#if VL_N64_FRAME_PACING
+    if (frame_work_avg > frame_interval * vi_ticks && frame_interval < FRAME_INTERVAL_MAX)
+        frame_interval++;
+    else if (frame_interval > 1 && frame_work_avg < (frame_interval - 1) * vi_ticks * 7 / 8)
+        frame_interval--;
+    //The frame goes up on the first retrace after it's shown
+    _vi_wait_until(frame_shown_vi + frame_interval - 1);
+#endif
+
+    uint32_t vi = vi_count + 1;
+    uint32_t vis = vi - frame_shown_vi;
+    if (frame_stats.shown > 0)
+    {
+        if (vis > (uint32_t)frame_interval)
+            frame_stats.late++;
+        frame_stats.max_vis = CK_Cross_max(frame_stats.max_vis, vis);
+    }
+    frame_stats.shown++;
+    frame_shown_vi = vi;
+#ifdef N64_INPUT_LATENCY
+    IN_N64_LatencyFrameShown(vi_last_ticks + (uint32_t)vi_ticks);
+#endif
 }
 
 static void VL_N64_SetVideoMode(int mode)
@@ -41,24 +897,46 @@ static void VL_N64_SetVideoMode(int mode)
     if (mode == 0xD)
     {
         resolution_t res = {
-            .height = 200,
-            .width = 320,
+            .height = 200 + 2 * VL_N64_BORDER,
+            .width = 320 + 2 * VL_N64_BORDER,
             .interlaced = 0
         };
-        display_init(res, DEPTH_16_BPP, 1, GAMMA_NONE, ANTIALIAS_RESAMPLE_FETCH_ALWAYS);
+        display_init(res, DEPTH_16_BPP, VL_N64_DISPLAY_BUFFERS, GAMMA_NONE, ANTIALIAS_RESAMPLE_FETCH_ALWAYS);
         rdpq_init();
+        _frame_start();
+        VL_N64_PlanarInit();
         rdpq_set_fill_color(RGBA32(0,0,0,255));
 
         display_width = 320;
         display_height = 200;
 
-        palette = (uint16_t *)memalign(64, sizeof(uint16_t) * 16);
-        assert(palette != NULL);
+        palette_tluts = (uint16_t *)memalign(64, sizeof(uint16_t) * PALETTE_TLUT_STRIDE * PALETTE_CACHE_SIZE);
+        assert(palette_tluts != NULL);
+        memset(palette_cache, 0, sizeof(palette_cache));
+        for (int i = 0; i < PALETTE_CACHE_SIZE; i++)
+        {
+            palette_cache[i].tlut = &palette_tluts[i * PALETTE_TLUT_STRIDE];
+            palette_cache[i].tlut[VL_N64_TRANSPARENT_INDEX] = 0x0000;
+        }
+        data_cache_hit_writeback_invalidate(palette_tluts, sizeof(uint16_t) * PALETTE_TLUT_STRIDE * PALETTE_CACHE_SIZE);
+        palette = NULL;
     }
     else
     {
+        if (sprite_queue_len)
+        {
+            _sprites_bake_until(sprite_queue_len - 1);
+        }
+        _tiles_bake_all();
+        _frame_stop();
+        _frame_log_stats();
+        VL_N64_GfxCacheLogStats();
+        VL_N64_GfxCacheFlush();
+        VL_N64_PlanarClose();
         rdpq_close();
-        free(palette);
+        free(palette_tluts);
+        palette_tluts = NULL;
+        palette = NULL;
     }
 }
 
@@ -66,16 +944,39 @@ static void *VL_N64_CreateSurface(int w, int h, VL_SurfaceUsage usage)
 {
     VL_N64_Surface *surf = (VL_N64_Surface *)malloc(sizeof(VL_N64_Surface));
     assert(surf != NULL);
+    surf->use = usage;
     surf->width = w;
     surf->height = h;
+    surf->ox = 0;
+    surf->oy = 0;
     surf->pixels = (uint8_t*)memalign(64, w * h);
     assert(surf->pixels != NULL);
+    if (usage == VL_SurfaceUsage_FrontBuffer)
+    {
+        front_surface = surf;
+        _mark_all_dirty();
+        if (VL_N64_TILE_LAYER && w % TILE_SIZE == 0 && h % TILE_SIZE == 0)
+        {
+            tile_cells_w = w / TILE_SIZE;
+            tile_cells = (VL_N64_Gfx **)calloc(tile_cells_w * (h / TILE_SIZE), sizeof(VL_N64_Gfx *));
+            assert(tile_cells != NULL);
+        }
+    }
     return surf;
 }
 
 static void VL_N64_DestroySurface(void *surface)
 {
     VL_N64_Surface *surf = (VL_N64_Surface *)surface;
+    if (surf == front_surface)
+    {
+        while (sprite_queue_len)
+            _sprite_remove(sprite_queue_len - 1);
+        _tiles_for_each(&(n64_rect_t){0, 0, surf->width, surf->height}, _tile_drop, NULL);
+        free(tile_cells);
+        tile_cells = NULL;
+        front_surface = NULL;
+    }
     if (surf->pixels)
         free(surf->pixels);
     free(surf);
@@ -96,158 +997,381 @@ static void VL_N64_GetSurfaceDimensions(void *surface, int *w, int *h)
         *h = surf->height;
 }
 
-static void VL_N64_RefreshPaletteAndBorderColor(void *screen)
+static uint16_t _ega_colour(uint8_t ega)
 {
-    _do_audio_update();
-    uint8_t r, g, b;
-    r = VL_EGARGBColorTable[vl_emuegavgaadapter.bordercolor][0];
-    g = VL_EGARGBColorTable[vl_emuegavgaadapter.bordercolor][1];
-    b = VL_EGARGBColorTable[vl_emuegavgaadapter.bordercolor][2];
-    border_colour = ((r >> 3) << 11) | ((g >> 3) << 6) | ((b >> 3) << 1) | 0x01; //rgba 5551
+    uint16_t c = ega_rgba5551[ega];
+    if (c == 0)
+    {
+        uint8_t r = VL_EGARGBColorTable[ega][0];
+        uint8_t g = VL_EGARGBColorTable[ega][1];
+        uint8_t b = VL_EGARGBColorTable[ega][2];
+        c = ((r >> 3) << 11) | ((g >> 3) << 6) | ((b >> 3) << 1) | 0x01; //rgba 5551
+        ega_rgba5551[ega] = c;
+    }
+    return c;
+}
 
+//TLUT for the 16 EGA colours in ega, from the cache or converted into the least recently used slot
+static uint16_t *_palette_tlut(const uint8_t *ega)
+{
+    palette_cache_t *slot = &palette_cache[0];
+    palette_uses++;
+    for (int i = 0; i < PALETTE_CACHE_SIZE; i++)
+    {
+        palette_cache_t *p = &palette_cache[i];
+        if (p->valid && memcmp(p->ega, ega, sizeof(p->ega)) == 0)
+        {
+            p->last_used = palette_uses;
+            return p->tlut;
+        }
+        if (!p->valid || (slot->valid && p->last_used < slot->last_used))
+        {
+            slot = p;
+        }
+    }
+
+    memcpy(slot->ega, ega, sizeof(slot->ega));
     for (int i = 0; i < 16; i++)
     {
-        r = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]][0];
-        g = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]][1];
-        b = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]][2];
-        uint16_t c = ((r >> 3) << 11) | ((g >> 3) << 6) | ((b >> 3) << 1) | 0x01; //rgba 5551
-        palette[i] = c;
+        slot->tlut[i] = _ega_colour(ega[i]);
     }
-    data_cache_hit_writeback_invalidate(palette, 16 * 2);
+    data_cache_hit_writeback(slot->tlut, VL_N64_PALETTE_ENTRIES * 2);
+    slot->valid = true;
+    slot->last_used = palette_uses;
+    return slot->tlut;
+}
+
+static void VL_N64_RefreshPaletteAndBorderColor(void *screen)
+{
+    uint32_t border = _ega_colour(vl_emuegavgaadapter.bordercolor);
+    uint16_t *tlut = _palette_tlut(vl_emuegavgaadapter.palette);
+    border_colour = border;
+    if (tlut == palette)
+    {
+        return;
+    }
+    palette = tlut;
     palette_dirty = true;
+
+    //Every display buffer needs redrawing with the new palette
+    for (int i = 0; i < MAX_DISPLAY_BUFFERS; i++)
+        _dirty_set_full(&display_buffers[i].dirty);
 }
 
 static int VL_N64_SurfacePGet(void *surface, int x, int y)
 {
-    _do_audio_update();
     VL_N64_Surface *surf = (VL_N64_Surface *)surface;
-    return ((uint8_t *)surf->pixels)[y * surf->width + x];
+    _layers_bake_region(surf, x, y, 1, 1);
+    return *_pixel_ptr(surf, x, y);
 }
 
 static void VL_N64_SurfaceRect(void *dst_surface, int x, int y, int w, int h, int colour)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_RECT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    for (int _y = y; _y < y + h; ++_y)
+    n64_rect_t r, pieces[4];
+    if (_clip_rect(surf, x, y, w, h, &r))
     {
-        memset(((uint8_t *)surf->pixels) + (_y * surf->width) + x, colour, CK_Cross_min(w, surf->width - x));
+        _layers_occlude(surf, x, y, w, h);
+        int n = _wrap_split(surf, &r, pieces);
+        for (int i = 0; i < n; i++)
+        {
+            for (int _y = pieces[i].y0; _y < pieces[i].y1; ++_y)
+            {
+                memset(_pixel_ptr(surf, pieces[i].x0, _y), colour, pieces[i].x1 - pieces[i].x0);
+            }
+        }
+        _mark_dirty(surf, x, y, w, h);
     }
+    N64_PROF_END();
+}
+
+//The map mask picks which bits of each pixel a draw writes, the EGA planes. Surface pixels only use the low
+//four, so a draw with all four enabled is the same as the unmasked version and one with none is a no-op.
+static bool _map_mask_trivial(int mapmask)
+{
+    return (mapmask & 0xF) == 0 || (mapmask & 0xF) == 0xF;
 }
 
 static void VL_N64_SurfaceRect_PM(void *dst_surface, int x, int y, int w, int h, int colour, int mapmask)
 {
-    _do_audio_update();
+    if (_map_mask_trivial(mapmask))
+    {
+        if (mapmask & 0xF)
+            VL_N64_SurfaceRect(dst_surface, x, y, w, h, colour & 0xF);
+        return;
+    }
+    N64_PROF_BEGIN(N64_PROF_RECT);
     mapmask &= 0xF;
     colour &= mapmask;
 
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    for (int _y = y; _y < y + h; ++_y)
+    n64_rect_t r, pieces[4];
+    if (_clip_rect(surf, x, y, w, h, &r))
     {
-        for (int _x = x; _x < x + w; ++_x)
+        _layers_bake_region(surf, x, y, w, h);
+        int n = _wrap_split(surf, &r, pieces);
+        for (int i = 0; i < n; i++)
         {
-            uint8_t *p = ((uint8_t *)surf->pixels) + _y * surf->width + _x;
-            *p &= ~mapmask;
-            *p |= colour;
+#if VL_N64_SWAR
+            VL_N64_RectToPAL8_PM(_pixel_ptr(surf, pieces[i].x0, pieces[i].y0), surf->width,
+                                 pieces[i].x1 - pieces[i].x0, pieces[i].y1 - pieces[i].y0, colour, mapmask);
+#else
+            for (int _y = pieces[i].y0; _y < pieces[i].y1; ++_y)
+            {
+                uint8_t *p = _pixel_ptr(surf, pieces[i].x0, _y);
+                for (int _x = pieces[i].x0; _x < pieces[i].x1; ++_x, ++p)
+                {
+                    *p &= ~mapmask;
+                    *p |= colour;
+                }
+            }
+#endif
         }
+        _mark_dirty(surf, x, y, w, h);
     }
+    N64_PROF_END();
 }
 
-static void VL_N64_SurfaceToSurface(void *src_surface, void *dst_surface, int x, int y, int sx, int sy, int sw, int sh)
+//Copies a rectangle between surfaces, or within one. Overlapping copies within a surface go a row at a
+//time through the scratch buffer, in the order that reads each source row before it is overwritten.
+static void _surface_copy(VL_N64_Surface *dest, int x, int y, VL_N64_Surface *src, int sx, int sy, int sw, int sh)
 {
-    _do_audio_update();
-    VL_N64_Surface *surf = (VL_N64_Surface *)src_surface;
-    VL_N64_Surface *dest = (VL_N64_Surface *)dst_surface;
-    for (int _y = sy; _y < sy + sh; ++_y)
-    {
-        memcpy(((uint8_t *)dest->pixels) + (_y - sy + y) * dest->width + x, ((uint8_t *)surf->pixels) + _y * surf->width + sx, sw);
-    }
-}
-
-static void VL_N64_SurfaceToSelf(void *surface, int x, int y, int sx, int sy, int sw, int sh)
-{
-    _do_audio_update();
-    VL_N64_Surface *srf = (VL_N64_Surface *)surface;
-    bool directionX = sx > x;
-    (void) directionX;
-    bool directionY = sy > y;
+    //Clip to both surfaces
+    int cx = CK_Cross_max(CK_Cross_max(-x, -sx), 0);
+    int cy = CK_Cross_max(CK_Cross_max(-y, -sy), 0);
+    x += cx, sx += cx, sw -= cx;
+    y += cy, sy += cy, sh -= cy;
+    sw = CK_Cross_min(sw, CK_Cross_min(dest->width - x, src->width - sx));
+    sh = CK_Cross_min(sh, CK_Cross_min(dest->height - y, src->height - sy));
+    if (sw <= 0 || sh <= 0)
+        return;
 
-    if (directionY)
+    _layers_bake_region(src, sx, sy, sw, sh);
+    _layers_occlude(dest, x, y, sw, sh);
+    if (dest != src)
     {
         for (int yi = 0; yi < sh; ++yi)
         {
-            memmove(((uint8_t *)srf->pixels) + ((yi + y) * srf->width + x), ((uint8_t *)srf->pixels) + ((sy + yi) * srf->width + sx), sw);
+            _copy_row(dest, x, y + yi, src, sx, sy + yi, sw);
         }
     }
     else
     {
-        for (int yi = sh - 1; yi >= 0; --yi)
+        //The scratch buffer has the same layout as a one row surface with no wrap
+        VL_N64_Surface row = {.width = sw, .height = 1};
+        _scratch_reserve(sw);
+        row.pixels = scratch_buf;
+        bool directionY = sy > y;
+        for (int i = 0; i < sh; ++i)
         {
-            memmove(((uint8_t *)srf->pixels) + ((yi + y) * srf->width + x), ((uint8_t *)srf->pixels) + ((sy + yi) * srf->width + sx), sw);
+            int yi = directionY ? i : sh - 1 - i;
+            _copy_row(&row, 0, 0, src, sx, sy + yi, sw);
+            _copy_row(dest, x, y + yi, &row, 0, 0, sw);
         }
     }
+    _mark_dirty(dest, x, y, sw, sh);
+}
+
+static void VL_N64_SurfaceToSurface(void *src_surface, void *dst_surface, int x, int y, int sx, int sy, int sw, int sh)
+{
+    N64_PROF_BEGIN(N64_PROF_BLIT);
+    _surface_copy((VL_N64_Surface *)dst_surface, x, y, (VL_N64_Surface *)src_surface, sx, sy, sw, sh);
+    N64_PROF_END();
+}
+
+static void VL_N64_SurfaceToSelf(void *surface, int x, int y, int sx, int sy, int sw, int sh)
+{
+    N64_PROF_BEGIN(N64_PROF_BLIT);
+    _surface_copy((VL_N64_Surface *)surface, x, y, (VL_N64_Surface *)surface, sx, sy, sw, sh);
+    N64_PROF_END();
 }
 
 static void VL_N64_UnmaskedToSurface(void *src, void *dst_surface, int x, int y, int w, int h)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_UnmaskedToPAL8(src, surf->pixels, x, y, surf->width, w, h);
+    //A new graphic converts on the RSP while the layers are sorted out
+    VL_N64_Gfx *gfx = VL_N64_GfxCacheGet(VL_N64_GFX_UNMASKED, src, w, h);
+    _layers_occlude(surf, x, y, w, h);
+    if (gfx && _tiles_place(surf, gfx, x, y))
+    {
+        //Drawn by the RDP from the tile layer
+    }
+    else if (gfx)
+    {
+        _gfx_to_surface(gfx, surf, x, y, 0);
+    }
+    else
+    {
+        draw_target_t t;
+        _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+        VL_UnmaskedToPAL8(src, t.pixels, 0, 0, t.pitch, w, h);
+        _target_end(&t);
+    }
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_UnmaskedToSurface_PM(void *src, void *dst_surface, int x, int y, int w, int h, int mapmask)
 {
-    _do_audio_update();
+    if (_map_mask_trivial(mapmask))
+    {
+        if (mapmask & 0xF)
+            VL_N64_UnmaskedToSurface(src, dst_surface, x, y, w, h);
+        return;
+    }
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_UnmaskedToPAL8_PM(src, surf->pixels, x, y, surf->width, w, h, mapmask);
+    _layers_bake_region(surf, x, y, w, h);
+    draw_target_t t;
+    _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+    VL_UnmaskedToPAL8_PM(src, t.pixels, 0, 0, t.pitch, w, h, mapmask);
+    _target_end(&t);
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_MaskedToSurface(void *src, void *dst_surface, int x, int y, int w, int h)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_MASKED_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_MaskedToPAL8(src, surf->pixels, x, y, surf->width, w, h);
+    VL_N64_Gfx *gfx = VL_N64_GfxCacheGet(VL_N64_GFX_MASKED, src, w, h);
+    _layers_bake_region(surf, x, y, w, h);
+    if (gfx)
+    {
+        _gfx_to_surface(gfx, surf, x, y, 0);
+    }
+    else
+    {
+        draw_target_t t;
+        _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+        VL_MaskedToPAL8(src, t.pixels, 0, 0, t.pitch, w, h);
+        _target_end(&t);
+    }
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_MaskedBlitToSurface(void *src, void *dst_surface, int x, int y, int w, int h)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_MASKED_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_MaskedBlitClipToPAL8(src, surf->pixels, x, y, surf->width, w, h, surf->width, surf->height);
+    VL_N64_Gfx *gfx = VL_N64_GfxCacheGet(VL_N64_GFX_SPRITE, src, w, h);
+    n64_rect_t r;
+    if (gfx && surf == front_surface && VL_N64_GfxCacheAcquireTex(gfx))
+    {
+        _sprites_queue(gfx, x, y);
+    }
+    else if (_clip_rect(surf, x, y, w, h, &r))
+    {
+        _layers_bake_region(surf, x, y, w, h);
+        if (gfx)
+        {
+            _gfx_to_surface(gfx, surf, x, y, 0);
+        }
+        else
+        {
+            draw_target_t t;
+            _target_begin(&t, surf, r);
+            VL_MaskedBlitClipToPAL8(src, t.pixels, x - r.x0, y - r.y0, t.pitch, w, h, r.x1 - r.x0, r.y1 - r.y0);
+            _target_end(&t);
+        }
+    }
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_BitToSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_1bppToPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    _layers_bake_region(surf, x, y, w, h);
+    VL_N64_Gfx *gfx = VL_N64_GfxCacheGet(VL_N64_GFX_1BPP, src, w, h);
+    if (gfx)
+    {
+        _gfx_to_surface(gfx, surf, x, y, colour);
+    }
+    else
+    {
+        //Not cached, which can mean the generic converter doesn't draw the way the 64-bit kernel would
+        draw_target_t t;
+        _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+        VL_1bppToPAL8(src, t.pixels, 0, 0, t.pitch, w, h, colour);
+        _target_end(&t);
+    }
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_BitToSurface_PM(void *src, void *dst_surface, int x, int y, int w, int h, int colour, int mapmask)
 {
-    _do_audio_update();
+    if (_map_mask_trivial(mapmask))
+    {
+        if (mapmask & 0xF)
+            VL_N64_BitToSurface(src, dst_surface, x, y, w, h, colour & 0xF);
+        return;
+    }
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_1bppToPAL8_PM(src, surf->pixels, x, y, surf->width, w, h, colour, mapmask);
+    _layers_bake_region(surf, x, y, w, h);
+    draw_target_t t;
+    _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+#if VL_N64_SWAR
+    VL_N64_1bppToPAL8_PM((const uint8_t *)src, 0, _1bpp_pitch(w), t.pixels, t.pitch, w, h, colour, mapmask);
+#else
+    VL_1bppToPAL8_PM(src, t.pixels, 0, 0, t.pitch, w, h, colour, mapmask);
+#endif
+    _target_end(&t);
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_BitXorWithSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_1bppXorWithPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    _layers_bake_region(surf, x, y, w, h);
+    draw_target_t t;
+    _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+#if VL_N64_SWAR
+    VL_N64_1bppXorWithPAL8((const uint8_t *)src, 0, _1bpp_pitch(w), t.pixels, t.pitch, w, h, colour);
+#else
+    VL_1bppXorWithPAL8(src, t.pixels, 0, 0, t.pitch, w, h, colour);
+#endif
+    _target_end(&t);
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_BitBlitToSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_1bppBlitToPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    _layers_bake_region(surf, x, y, w, h);
+    draw_target_t t;
+    _target_begin(&t, surf, (n64_rect_t){x, y, x + w, y + h});
+    VL_1bppBlitToPAL8(src, t.pixels, 0, 0, t.pitch, w, h, colour);
+    _target_end(&t);
+    _mark_dirty(surf, x, y, w, h);
+    N64_PROF_END();
 }
 
 static void VL_N64_BitInvBlitToSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_BLIT);
     VL_N64_Surface *surf = (VL_N64_Surface *)dst_surface;
-    VL_1bppInvBlitClipToPAL8(src, surf->pixels, x, y, surf->width, w, h, surf->width, surf->height, colour);
+    n64_rect_t r;
+    if (_clip_rect(surf, x, y, w, h, &r))
+    {
+        _layers_bake_region(surf, x, y, w, h);
+        draw_target_t t;
+        _target_begin(&t, surf, r);
+        VL_1bppInvBlitClipToPAL8(src, t.pixels, x - r.x0, y - r.y0, t.pitch, w, h, r.x1 - r.x0, r.y1 - r.y0, colour);
+        _target_end(&t);
+        _mark_dirty(surf, x, y, w, h);
+    }
+    N64_PROF_END();
 }
 
 static int VL_N64_GetActiveBufferId(void *surface)
@@ -255,65 +1379,120 @@ static int VL_N64_GetActiveBufferId(void *surface)
     return 0;
 }
 
+//The engine sees one buffer; the surface is composed into the display buffers in VL_N64_Present
 static int VL_N64_GetNumBuffers(void *surface)
 {
     (void)surface;
     return 1;
 }
 
+//Moves the surface contents by -x, -y. Only the origin moves, so what scrolls in from an edge is whatever
+//scrolled out of the opposite one; the refresh manager redraws those tiles anyway.
 static void VL_N64_ScrollSurface(void *surface, int x, int y)
 {
-    _do_audio_update();
+    N64_PROF_BEGIN(N64_PROF_SCROLL);
     VL_N64_Surface *surf = (VL_N64_Surface *)surface;
-    int dx = 0, dy = 0, sx = 0, sy = 0;
-    int w = surf->width - CK_Cross_max(x, -x), h = surf->height - CK_Cross_max(y, -y);
-    if (x > 0)
-    {
-        dx = 0;
-        sx = x;
-    }
-    else
-    {
-        dx = -x;
-        sx = 0;
-    }
-    if (y > 0)
+    if (surf == front_surface)
     {
-        dy = 0;
-        sy = y;
+        _sprites_scroll(x, y);
+        //No pixels move so there's nothing to write back, but every display buffer is now out of date
+        for (int i = 0; i < MAX_DISPLAY_BUFFERS; i++)
+            _dirty_set_full(&display_buffers[i].dirty);
     }
-    else
-    {
-        dy = -y;
-        sy = 0;
-    }
-    VL_N64_SurfaceToSelf(surface, dx, dy, sx, sy, w, h);
+    surf->ox = ((surf->ox + x) % surf->width + surf->width) % surf->width;
+    surf->oy = ((surf->oy + y) % surf->height + surf->height) % surf->height;
+    N64_PROF_END();
+}
+
+//Fills the four bands of the framebuffer around the game view
+static void _border_fill(uint32_t colour)
+{
+    int w = display_width + 2 * VL_N64_BORDER, h = display_height + 2 * VL_N64_BORDER;
+    rdpq_set_mode_fill(color_from_packed16(colour));
+    rdpq_fill_rectangle(0, 0, w, VL_N64_BORDER);
+    rdpq_fill_rectangle(0, h - VL_N64_BORDER, w, h);
+    rdpq_fill_rectangle(0, VL_N64_BORDER, VL_N64_BORDER, h - VL_N64_BORDER);
+    rdpq_fill_rectangle(w - VL_N64_BORDER, VL_N64_BORDER, w, h - VL_N64_BORDER);
 }
 
 static void VL_N64_Present(void *surface, int scrlX, int scrlY, bool singleBuffered)
 {
-    _do_audio_update();
+    SD_N64_AudioPoll();
+    romfs_poll();
+    N64_PROF_BEGIN(N64_PROF_PRESENT);
 
     VL_N64_Surface *src = (VL_N64_Surface *)surface;
 
     src->width = CK_Cross_min(src->width, 1024);
 
-    disp = display_get();
+    disp = _frame_get_buffer();
     if (!disp)
     {
+        N64_PROF_END();
         return;
     }
 
-    data_cache_hit_writeback_invalidate(src->pixels, src->width * src->height);
+    //Only surfaces that aren't tracked, or a lot of damage, need the whole surface written back and drawn
+    display_buffer_t *buf = _display_buffer_for(disp);
+    bool tracked = (src == front_surface);
+    if (!tracked)
+    {
+        _dirty_set_full(&frame_dirty);
+        _dirty_set_full(&buf->dirty);
+    }
+    if (buf->scrlX != scrlX || buf->scrlY != scrlY)
+    {
+        _dirty_set_full(&buf->dirty);
+    }
+
+    n64_rect_t view = {scrlX, scrlY, scrlX + (int)display_width, scrlY + (int)display_height};
+    int damage = 0;
+    for (int i = 0; i < buf->dirty.num; i++)
+    {
+        n64_rect_t r = buf->dirty.rects[i];
+        if (_rect_overlaps(&r, &view))
+        {
+            n64_rect_t c = {
+                CK_Cross_max(r.x0, view.x0), CK_Cross_max(r.y0, view.y0),
+                CK_Cross_min(r.x1, view.x1), CK_Cross_min(r.y1, view.y1)
+            };
+            damage += _rect_area(&c);
+        }
+    }
+    if (damage * 100 > _rect_area(&view) * DIRTY_FULL_PERCENT)
+    {
+        _dirty_set_full(&buf->dirty);
+    }
+
+    if (frame_dirty.full)
+    {
+        data_cache_hit_writeback_invalidate(src->pixels, src->width * src->height);
+    }
+    else
+    {
+        for (int i = 0; i < frame_dirty.num; i++)
+        {
+            n64_rect_t *r = &frame_dirty.rects[i];
+            for (int y = r->y0; y < r->y1; y++)
+            {
+                data_cache_hit_writeback(src->pixels + y * src->width + r->x0, r->x1 - r->x0);
+            }
+        }
+    }
 
     rdpq_attach(disp, NULL);
-    rdpq_set_scissor(0, 0, display_width, display_height);
+    if (VL_N64_BORDER > 0 && buf->border != border_colour)
+    {
+        _border_fill(border_colour);
+        buf->border = border_colour;
+    }
+    rdpq_set_scissor(VL_N64_BORDER, VL_N64_BORDER, VL_N64_BORDER + display_width, VL_N64_BORDER + display_height);
     rdpq_set_mode_standard();
     rdpq_mode_tlut(TLUT_RGBA16);
 
     if (palette_dirty)
     {
-        rdpq_tex_upload_tlut(palette, 0, 16);
+        rdpq_tex_upload_tlut(palette, 0, VL_N64_PALETTE_ENTRIES);
         palette_dirty = false;
     }
 
@@ -325,22 +1504,67 @@ static void VL_N64_Present(void *surface, int scrlX, int scrlY, bool singleBuffe
             .flags = FMT_CI8
         };
 
-    rdpq_tex_blit(&tex, -scrlX, -scrlY, NULL);
+    //The tile layer goes over the pixels in each redrawn rectangle
+    n64_rect_t r;
+    int scrl[2] = {scrlX - VL_N64_BORDER, scrlY - VL_N64_BORDER};
+    if (buf->dirty.full)
+    {
+        if (_clip_rect(src, view.x0, view.y0, view.x1 - view.x0, view.y1 - view.y0, &r))
+        {
+            _surface_blit(&tex, src, &r, scrl[0], scrl[1]);
+            if (tracked)
+                _tiles_for_each(&r, _tile_draw, scrl);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < buf->dirty.num; i++)
+        {
+            n64_rect_t *d = &buf->dirty.rects[i];
+            int x0 = CK_Cross_max(d->x0, view.x0), y0 = CK_Cross_max(d->y0, view.y0);
+            int x1 = CK_Cross_min(d->x1, view.x1), y1 = CK_Cross_min(d->y1, view.y1);
+            if (_clip_rect(src, x0, y0, x1 - x0, y1 - y0, &r))
+            {
+                _surface_blit(&tex, src, &r, scrl[0], scrl[1]);
+                if (tracked)
+                    _tiles_for_each(&r, _tile_draw, scrl);
+            }
+        }
+    }
+    _dirty_clear(&frame_dirty);
+    _dirty_clear(&buf->dirty);
+    buf->scrlX = scrlX;
+    buf->scrlY = scrlY;
+
+    if (tracked)
+    {
+        _sprites_draw(buf, scrlX - VL_N64_BORDER, scrlY - VL_N64_BORDER);
+    }
+    VL_N64_GfxCacheNextFrame();
+#ifdef N64_PROFILE
+    static int stats_frame = 0;
+    if (++stats_frame % N64_PROF_RING_FRAMES == 0)
+    {
+        VL_N64_GfxCacheLogStats();
+        _frame_log_stats();
+    }
+#endif
+    N64_PROF_END();
+    N64_PROF_FRAME_END();
+    N64_PROF_DRAW_OVERLAY(8, 8);
+    _frame_pace();
     rdpq_detach_show();
+    frame_start_ticks = timer_ticks();
 }
 
 static void VL_N64_FlushParams()
 {
-    _do_audio_update();
+    SD_N64_AudioPoll();
 }
 
 static void VL_N64_WaitVBLs(int vbls)
 {
-    long long micros = timer_ticks() + TIMER_TICKS_LL(1000000 * vbls / 60);
-    do
-    {
-        _do_audio_update();
-    } while (timer_ticks() < micros);
+    _vi_wait_until(vi_count + vbls);
 }
 
 static void VL_N64_SyncBuffers(void *surface)
@@ -350,11 +1574,7 @@ static void VL_N64_SyncBuffers(void *surface)
 
 static void VL_N64_UpdateRect(void *surface, int x, int y, int w, int h)
 {
-	(void)surface;
-	(void)x;
-	(void)y;
-	(void)w;
-	(void)h;
+    _mark_dirty((VL_N64_Surface *)surface, x, y, w, h);
 }
 
 VL_Backend vl_n64_backend =
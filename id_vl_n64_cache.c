@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <libdragon.h>
+
+#include "id_vl.h"
+#include "id_vl_private.h"
+#include "id_vl_n64_private.h"
+#include "ck_cross.h"
+
+//Converted graphics are looked up by source pointer, size and kind. Graphics chunks are purged and reloaded
+//by the memory manager, so a matching pointer alone isn't trusted; each entry also stores a hash of the
+//source data, which is far cheaper to compute than the planar conversion it saves.
+#define GFX_CACHE_BUCKETS 512
+
+static VL_N64_Gfx *gfx_buckets[GFX_CACHE_BUCKETS];
+static VL_N64_Gfx *lru_head = NULL; //Most recently used
+static VL_N64_Gfx *lru_tail = NULL;
+static VL_N64_GfxCacheStats gfx_stats;
+static uint32_t gfx_frame = 0;
+
+static int _source_len(VL_N64_GfxKind kind, int w, int h)
+{
+    switch (kind)
+    {
+        case VL_N64_GFX_UNMASKED:
+            return (w / 8) * h * 4;
+        case VL_N64_GFX_MASKED:
+        case VL_N64_GFX_SPRITE:
+            return (w / 8) * h * 5;
+        case VL_N64_GFX_1BPP:
+        default:
+            return ((w + 7) / 8) * h;
+    }
+}
+
+static uint32_t _hash_source(const void *src, int len)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    uint32_t h = 2166136261u;
+    uint32_t word;
+    while (len >= 4)
+    {
+        memcpy(&word, p, 4);
+        h = (h ^ word) * 16777619u;
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+    {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h;
+}
+
+static int _bucket_for(const void *src, int w, int h)
+{
+    uintptr_t v = (uintptr_t)src;
+    return (int)((v ^ (v >> 9) ^ (w << 3) ^ h) % GFX_CACHE_BUCKETS);
+}
+
+static void _lru_unlink(VL_N64_Gfx *gfx)
+{
+    if (gfx->lru_prev)
+        gfx->lru_prev->lru_next = gfx->lru_next;
+    else
+        lru_head = gfx->lru_next;
+    if (gfx->lru_next)
+        gfx->lru_next->lru_prev = gfx->lru_prev;
+    else
+        lru_tail = gfx->lru_prev;
+    gfx->lru_prev = gfx->lru_next = NULL;
+}
+
+static void _lru_push_front(VL_N64_Gfx *gfx)
+{
+    gfx->lru_prev = NULL;
+    gfx->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = gfx;
+    lru_head = gfx;
+    if (lru_tail == NULL)
+        lru_tail = gfx;
+}
+
+static void _free_gfx(VL_N64_Gfx *gfx)
+{
+    VL_N64_Gfx **link = &gfx_buckets[_bucket_for(gfx->src, gfx->width, gfx->height)];
+    while (*link != gfx)
+        link = &(*link)->hnext;
+    *link = gfx->hnext;
+    _lru_unlink(gfx);
+    if (gfx->converting)
+        VL_N64_PlanarWait(gfx->planar_sync);
+
+    gfx_stats.bytes -= gfx->bytes;
+    gfx_stats.entries--;
+    free(gfx->pixels);
+    free(gfx->mask);
+    if (gfx->tex != gfx->pixels)
+        free(gfx->tex);
+    free(gfx);
+}
+
+//Textures queued for drawing, or drawn by the RDP this frame or the last, can't be freed yet.
+static bool _is_evictable(const VL_N64_Gfx *gfx)
+{
+    return gfx->refs == 0 && (gfx->tex == NULL || gfx->last_frame + 1 < gfx_frame);
+}
+
+static void _evict_to_budget(size_t incoming)
+{
+    VL_N64_Gfx *gfx = lru_tail;
+    while (gfx && gfx_stats.bytes + incoming > VL_N64_GFX_CACHE_BUDGET)
+    {
+        VL_N64_Gfx *prev = gfx->lru_prev;
+        if (_is_evictable(gfx))
+        {
+            _free_gfx(gfx);
+            gfx_stats.evictions++;
+        }
+        gfx = prev;
+    }
+}
+
+static uint8_t *_pack_mask(const uint8_t *set, int len)
+{
+    uint8_t *mask = calloc((len + 7) / 8, 1);
+    assert(mask != NULL);
+    for (int i = 0; i < len; i++)
+    {
+        if (set[i])
+            mask[i >> 3] |= 0x80 >> (i & 7);
+    }
+    return mask;
+}
+
+#ifdef VL_N64_PLANAR_VERIFY
+static void _planar_verify(const VL_N64_Gfx *gfx)
+{
+    int len = gfx->width * gfx->height;
+    uint8_t *pixels = malloc(len + len / 8);
+    assert(pixels != NULL);
+    uint8_t *mask = gfx->mask ? pixels + len : NULL;
+    VL_N64_PlanarToPAL8((const uint8_t *)gfx->src, len / 8, pixels, mask);
+    if (memcmp(pixels, gfx->pixels, len) != 0 || (mask && memcmp(mask, gfx->mask, len / 8) != 0))
+    {
+        debugf("gfx cache: RSP conversion of %dx%d at %p differs from VL_N64_PlanarToPAL8\n", gfx->width,
+               gfx->height, gfx->src);
+    }
+    free(pixels);
+}
+#endif
+
+//The generic converters are run over scratch backgrounds and the results compared to recover the colour
+//and mask of every pixel. The masked converters behave as dst = (dst & mask) | colour per pixel, which is
+//what the cached copy reproduces. A third background verifies that model; if it doesn't hold the entry
+//is kept but marked uncacheable so the caller always uses the generic converter.
+static bool _convert_generic(VL_N64_Gfx *gfx, void *src)
+{
+    int w = gfx->width, h = gfx->height, len = w * h;
+    uint8_t *a = malloc(len * 3);
+    assert(a != NULL);
+    uint8_t *b = a + len;
+    uint8_t *v = b + len;
+    bool ok = true;
+
+    switch (gfx->kind)
+    {
+        case VL_N64_GFX_UNMASKED:
+            VL_UnmaskedToPAL8(src, a, 0, 0, w, w, h);
+            gfx->pixels = (uint8_t *)memalign(16, len); //Tiles are drawn by the RDP straight from here
+            assert(gfx->pixels != NULL);
+            memcpy(gfx->pixels, a, len);
+            break;
+
+        case VL_N64_GFX_MASKED:
+        case VL_N64_GFX_SPRITE:
+            memset(a, 0x00, len);
+            memset(b, 0x0F, len);
+            memset(v, 0x05, len);
+            if (gfx->kind == VL_N64_GFX_MASKED)
+            {
+                VL_MaskedToPAL8(src, a, 0, 0, w, w, h);
+                VL_MaskedToPAL8(src, b, 0, 0, w, w, h);
+                VL_MaskedToPAL8(src, v, 0, 0, w, w, h);
+            }
+            else
+            {
+                VL_MaskedBlitClipToPAL8(src, a, 0, 0, w, w, h, w, h);
+                VL_MaskedBlitClipToPAL8(src, b, 0, 0, w, w, h, w, h);
+                VL_MaskedBlitClipToPAL8(src, v, 0, 0, w, w, h, w, h);
+            }
+            for (int i = 0; i < len; i++)
+            {
+                b[i] = (b[i] != a[i]);
+                if (v[i] != ((b[i] ? 0x05 : 0x00) | a[i]))
+                    ok = false;
+            }
+            if (!ok)
+                break;
+            gfx->pixels = malloc(len);
+            assert(gfx->pixels != NULL);
+            memcpy(gfx->pixels, a, len);
+            gfx->mask = _pack_mask(b, len);
+            //A texel that is masked but still ORs in colour can't be reproduced by the RDP
+            for (int i = 0; i < len; i++)
+            {
+                if (b[i] && a[i])
+                    gfx->no_tex = true;
+            }
+            break;
+
+        case VL_N64_GFX_1BPP:
+            memset(a, 0x00, len);
+            memset(v, 0x05, len);
+            VL_1bppToPAL8(src, a, 0, 0, w, w, h, 0x0F);
+            VL_1bppToPAL8(src, v, 0, 0, w, w, h, 0x0A);
+            for (int i = 0; i < len; i++)
+            {
+                a[i] = (a[i] == 0x0F);
+                if (v[i] != (a[i] ? 0x0A : 0x05))
+                    ok = false;
+            }
+            if (ok)
+                gfx->mask = _pack_mask(a, len);
+            break;
+    }
+    free(a);
+
+    gfx->uncacheable = !ok;
+    gfx->bytes = sizeof(VL_N64_Gfx);
+    if (gfx->pixels)
+        gfx->bytes += len;
+    if (gfx->mask)
+        gfx->bytes += (len + 7) / 8;
+    return ok;
+}
+
+#define GFX_DMA_ALIGN(x) (((x) + 15) & ~15)
+
+//The RSP knows the EGA layout rather than going through the generic converters, so it only gives the same
+//result if they follow the model _convert_generic checks for. That's down to the converters rather than the
+//graphic, so the first graphic of each kind that could go to the RSP is also converted the generic way and
+//compared with VL_N64_PlanarToPAL8, the C version of the RSP code. 1 if they match, 0 if not, -1 untested.
+static int planar_matches_generic[2] = {-1, -1}; //Unmasked, masked
+
+static bool _planar_check(const VL_N64_Gfx *gfx, void *src)
+{
+    int len = gfx->width * gfx->height;
+    VL_N64_Gfx ref = {.kind = gfx->kind, .width = gfx->width, .height = gfx->height};
+    bool ok = _convert_generic(&ref, src);
+    if (ok)
+    {
+        uint8_t *pixels = malloc(len + len / 8);
+        assert(pixels != NULL);
+        uint8_t *mask = ref.mask ? pixels + len : NULL;
+        VL_N64_PlanarToPAL8((const uint8_t *)src, len / 8, pixels, mask);
+        ok = memcmp(pixels, ref.pixels, len) == 0;
+        for (int i = 0; mask && ok && i < len; i++)
+        {
+            //Whether a pixel of colour 15 is masked makes no difference, and the generic way can't tell
+            bool differs = (mask[i >> 3] ^ ref.mask[i >> 3]) & (0x80 >> (i & 7));
+            ok = !differs || pixels[i] == 0x0F;
+        }
+        free(pixels);
+    }
+    free(ref.pixels);
+    free(ref.mask);
+    if (!ok)
+        debugf("gfx cache: %s graphics don't convert on the RSP like the generic converter does, not using it\n",
+               gfx->kind == VL_N64_GFX_MASKED ? "masked" : "unmasked");
+    return ok;
+}
+
+//Large unmasked and masked graphics are queued on the RSP. The caller waits with VL_N64_GfxCacheWait before
+//the source can go away.
+static bool _convert_rsp(VL_N64_Gfx *gfx, void *src)
+{
+    int len = gfx->width * gfx->height;
+    if (gfx->kind != VL_N64_GFX_UNMASKED && gfx->kind != VL_N64_GFX_MASKED)
+        return false;
+    if (VL_N64_PLANAR_MIN_PIXELS == 0 || len < VL_N64_PLANAR_MIN_PIXELS || (gfx->width & 7) ||
+        !VL_N64_PlanarCanQueue(src, len / 8))
+        return false;
+    int *matches = &planar_matches_generic[gfx->kind == VL_N64_GFX_MASKED];
+    if (*matches < 0)
+        *matches = _planar_check(gfx, src);
+    if (!*matches)
+        return false;
+
+    gfx->pixels = (uint8_t *)memalign(16, len);
+    assert(gfx->pixels != NULL);
+    if (gfx->kind == VL_N64_GFX_MASKED)
+    {
+        //Whole cache lines, so nothing else on the heap shares one the RSP writes to
+        gfx->mask = (uint8_t *)memalign(16, GFX_DMA_ALIGN(len / 8));
+        assert(gfx->mask != NULL);
+    }
+    gfx->planar_sync = VL_N64_PlanarQueue((const uint8_t *)src, len / 8, gfx->pixels, gfx->mask);
+    gfx->converting = true;
+    gfx->bytes = sizeof(VL_N64_Gfx) + len + (gfx->mask ? len / 8 : 0);
+    return true;
+}
+
+static bool _convert(VL_N64_Gfx *gfx, void *src)
+{
+    return _convert_rsp(gfx, src) || _convert_generic(gfx, src);
+}
+
+VL_N64_Gfx *VL_N64_GfxCacheGet(VL_N64_GfxKind kind, void *src, int w, int h)
+{
+    uint32_t hash = _hash_source(src, _source_len(kind, w, h));
+    int bucket = _bucket_for(src, w, h);
+
+    VL_N64_Gfx *gfx = gfx_buckets[bucket];
+    while (gfx)
+    {
+        if (gfx->src == src && gfx->width == w && gfx->height == h && gfx->kind == kind)
+            break;
+        gfx = gfx->hnext;
+    }
+
+    if (gfx && gfx->hash != hash)
+    {
+        //Same address, different data. Drop it unless something still holds it, in which case don't cache.
+        if (!_is_evictable(gfx))
+        {
+            gfx_stats.misses++;
+            return NULL;
+        }
+        _free_gfx(gfx);
+        gfx = NULL;
+    }
+
+    if (gfx)
+    {
+        gfx_stats.hits++;
+        _lru_unlink(gfx);
+        _lru_push_front(gfx);
+    }
+    else
+    {
+        gfx_stats.misses++;
+        gfx = calloc(1, sizeof(VL_N64_Gfx));
+        assert(gfx != NULL);
+        gfx->kind = kind;
+        gfx->src = src;
+        gfx->width = w;
+        gfx->height = h;
+        gfx->hash = hash;
+        _convert(gfx, src);
+        _evict_to_budget(gfx->bytes);
+
+        gfx->hnext = gfx_buckets[bucket];
+        gfx_buckets[bucket] = gfx;
+        _lru_push_front(gfx);
+        gfx_stats.bytes += gfx->bytes;
+        gfx_stats.entries++;
+    }
+
+    return gfx->uncacheable ? NULL : gfx;
+}
+
+//An entry from VL_N64_GfxCacheGet may still be converting on the RSP. This has to be called before it's
+//drawn, and before the call that got it returns since the engine can free the source after that.
+void VL_N64_GfxCacheWait(VL_N64_Gfx *gfx)
+{
+    if (!gfx->converting)
+        return;
+    VL_N64_PlanarWait(gfx->planar_sync);
+    gfx->converting = false;
+#ifdef VL_N64_PLANAR_VERIFY
+    _planar_verify(gfx);
+#endif
+}
+
+//Makes sure a sprite or unmasked entry has its RDP texture and holds a reference to it until
+//VL_N64_GfxCacheRelease. Returns false if the graphic can only be drawn on the CPU. An unmasked graphic is
+//opaque, so its texture is the converted pixels themselves, written back to RDRAM the first time.
+bool VL_N64_GfxCacheAcquireTex(VL_N64_Gfx *gfx)
+{
+    if (gfx->kind == VL_N64_GFX_UNMASKED)
+    {
+        if (gfx->tex == NULL)
+        {
+            VL_N64_GfxCacheWait(gfx);
+            data_cache_hit_writeback(gfx->pixels, gfx->width * gfx->height);
+            gfx->tex = gfx->pixels;
+        }
+    }
+    else if (gfx->kind != VL_N64_GFX_SPRITE || gfx->no_tex)
+    {
+        return false;
+    }
+    else if (gfx->tex == NULL)
+    {
+        int len = gfx->width * gfx->height;
+        gfx->tex = (uint8_t *)memalign(64, len);
+        assert(gfx->tex != NULL);
+        for (int i = 0; i < len; i++)
+        {
+            bool masked = gfx->mask[i >> 3] & (0x80 >> (i & 7));
+            gfx->tex[i] = masked ? VL_N64_TRANSPARENT_INDEX : gfx->pixels[i];
+        }
+        data_cache_hit_writeback_invalidate(gfx->tex, len);
+        gfx->bytes += len;
+        gfx_stats.bytes += len;
+    }
+
+    gfx->refs++;
+    gfx->last_frame = gfx_frame;
+    return true;
+}
+
+void VL_N64_GfxCacheRelease(VL_N64_Gfx *gfx)
+{
+    assert(gfx->refs > 0);
+    gfx->refs--;
+    gfx->last_frame = gfx_frame;
+}
+
+void VL_N64_GfxCacheNextFrame(void)
+{
+    gfx_frame++;
+}
+
+void VL_N64_GfxCacheFlush(void)
+{
+    for (int i = 0; i < GFX_CACHE_BUCKETS; i++)
+    {
+        VL_N64_Gfx *gfx = gfx_buckets[i];
+        while (gfx)
+        {
+            VL_N64_Gfx *next = gfx->hnext;
+            if (gfx->refs == 0)
+                _free_gfx(gfx);
+            gfx = next;
+        }
+    }
+}
+
+void VL_N64_GfxCacheGetStats(VL_N64_GfxCacheStats *stats)
+{
+    *stats = gfx_stats;
+}
+
+void VL_N64_GfxCacheLogStats(void)
+{
+    debugf("gfx cache: %lu hits, %lu misses, %lu evictions, %lu entries, %lu/%lu bytes\n",
+           (unsigned long)gfx_stats.hits, (unsigned long)gfx_stats.misses, (unsigned long)gfx_stats.evictions,
+           (unsigned long)gfx_stats.entries, (unsigned long)gfx_stats.bytes, (unsigned long)VL_N64_GFX_CACHE_BUDGET);
+}
+
+//Draw a cached entry to a PAL8 buffer, clipped to dw x dh. Colour is only used for 1bpp entries.
+void VL_N64_GfxToPAL8(const VL_N64_Gfx *gfx, uint8_t *dest, int x, int y, int pitch, int dw, int dh, int colour)
+{
+    int sx0 = CK_Cross_max(0, -x);
+    int sy0 = CK_Cross_max(0, -y);
+    int sx1 = CK_Cross_min(gfx->width, dw - x);
+    int sy1 = CK_Cross_min(gfx->height, dh - y);
+    if (sx0 >= sx1 || sy0 >= sy1)
+        return;
+
+#if VL_N64_SWAR
+    if (gfx->kind == VL_N64_GFX_1BPP)
+    {
+        VL_N64_1bppToPAL8_PM(gfx->mask, sy0 * gfx->width + sx0, gfx->width, dest + (y + sy0) * pitch + x + sx0,
+                             pitch, sx1 - sx0, sy1 - sy0, colour, 0xFF);
+        return;
+    }
+#endif
+
+    for (int sy = sy0; sy < sy1; sy++)
+    {
+        uint8_t *out = dest + (y + sy) * pitch + x + sx0;
+        int i = sy * gfx->width + sx0;
+        const uint8_t *in = gfx->pixels ? gfx->pixels + i : NULL;
+
+        if (gfx->mask == NULL)
+        {
+            memcpy(out, in, sx1 - sx0);
+            continue;
+        }
+
+        for (int sx = sx0; sx < sx1; sx++, i++, out++)
+        {
+            bool masked = gfx->mask[i >> 3] & (0x80 >> (i & 7));
+            if (gfx->kind == VL_N64_GFX_1BPP)
+            {
+                if (masked)
+                    *out = colour;
+            }
+            else
+            {
+                *out = masked ? (*out | *in) : *in;
+                in++;
+            }
+        }
+    }
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// EGA planar graphics to CI8 on the RSP, with the overlay in rsp_planar.S. The conversion cache queues large
+// graphics here instead of running the generic converters, and waits for them the first time they're drawn.
+// VL_N64_PlanarToPAL8 does the same conversion on the CPU. It's what the host build runs in place of the
+// RSP, and with VL_N64_PLANAR_VERIFY every RSP conversion is checked against it, so the microcode can be
+// verified on an emulator that runs the RSP.
+
+#include <string.h>
+#include <libdragon.h>
+
+#include "id_vl_n64_private.h"
+
+#ifndef N64_HOST
+DEFINE_RSP_UCODE(rsp_planar);
+
+#define PLANAR_CMD_CONVERT 0x0
+
+static uint32_t planar_ovl_id;
+#endif
+
+void VL_N64_PlanarToPAL8(const uint8_t *src, int plane_bytes, uint8_t *pixels, uint8_t *mask)
+{
+    const uint8_t *planes = src;
+    if (mask)
+    {
+        memcpy(mask, src, plane_bytes);
+        planes += plane_bytes;
+    }
+    for (int i = 0; i < plane_bytes; i++)
+    {
+        uint8_t p0 = planes[i];
+        uint8_t p1 = planes[plane_bytes + i];
+        uint8_t p2 = planes[plane_bytes * 2 + i];
+        uint8_t p3 = planes[plane_bytes * 3 + i];
+        for (int j = 0; j < 8; j++)
+        {
+            int s = 7 - j;
+            *pixels++ = ((p0 >> s) & 1) | (((p1 >> s) & 1) << 1) | (((p2 >> s) & 1) << 2) | (((p3 >> s) & 1) << 3);
+        }
+    }
+}
+
+void VL_N64_PlanarInit(void)
+{
+#ifndef N64_HOST
+    planar_ovl_id = rspq_overlay_register(&rsp_planar);
+#endif
+}
+
+void VL_N64_PlanarClose(void)
+{
+#ifndef N64_HOST
+    rspq_overlay_unregister(planar_ovl_id);
+#endif
+}
+
+//The RSP DMAs 8 byte aligned blocks, so each plane has to start on one
+bool VL_N64_PlanarCanQueue(const void *src, int plane_bytes)
+{
+    return ((uintptr_t)src & 7) == 0 && (plane_bytes & 7) == 0 && plane_bytes > 0;
+}
+
+//pixels and mask must be 16 byte aligned, they're invalidated from the data cache here
+int VL_N64_PlanarQueue(const uint8_t *src, int plane_bytes, uint8_t *pixels, uint8_t *mask)
+{
+#ifdef N64_HOST
+    //No RSP on the host
+    VL_N64_PlanarToPAL8(src, plane_bytes, pixels, mask);
+    return 0;
+#else
+    data_cache_hit_writeback(src, plane_bytes * (mask ? 5 : 4));
+    data_cache_hit_writeback_invalidate(pixels, plane_bytes * 8);
+    if (mask)
+        data_cache_hit_writeback_invalidate(mask, plane_bytes);
+    rspq_write(planar_ovl_id, PLANAR_CMD_CONVERT, plane_bytes, PhysicalAddr(src), PhysicalAddr(pixels),
+               mask ? PhysicalAddr(mask) : 0);
+    int sync = rspq_syncpoint_new();
+    rspq_flush();
+    return sync;
+#endif
+}
+
+void VL_N64_PlanarWait(int sync)
+{
+#ifndef N64_HOST
+    rspq_syncpoint_wait(sync);
+#endif
+}
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef ID_VL_N64_PRIVATE_H
+#define ID_VL_N64_PRIVATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "id_vl.h"
+
+//Surfaces wrap around in both directions: pixel (x, y) is stored at ((x + ox) % width, (y + oy) % height)
+//so scrolling a surface only moves its origin.
+typedef struct VL_N64_Surface
+{
+    VL_SurfaceUsage use;
+    int width, height;
+    int ox, oy;
+    uint8_t *pixels;
+} VL_N64_Surface;
+
+//Colour index used for transparent texels in converted sprites. It sits just past the 16 EGA
+//colours so the TLUT entry can have its alpha bit clear and the RDP alpha compare drops it.
+#define VL_N64_TRANSPARENT_INDEX 16
+#define VL_N64_PALETTE_ENTRIES 17
+
+//Memory the conversion cache may use before evicting the least recently used entries.
+#ifndef VL_N64_GFX_CACHE_BUDGET
+#define VL_N64_GFX_CACHE_BUDGET (512 * 1024)
+#endif
+
+typedef enum
+{
+    VL_N64_GFX_UNMASKED, //VL_UnmaskedToPAL8 source
+    VL_N64_GFX_MASKED,   //VL_MaskedToPAL8 source
+    VL_N64_GFX_SPRITE,   //VL_MaskedBlitClipToPAL8 source
+    VL_N64_GFX_1BPP      //VL_1bppToPAL8 source
+} VL_N64_GfxKind;
+
+//EGA planar graphics converted once to CI8 and kept for repeat blits.
+typedef struct VL_N64_Gfx
+{
+    VL_N64_GfxKind kind;
+    const void *src;
+    int width, height;
+    uint32_t hash;
+    uint8_t *pixels;  //width * height CI8 colour, NULL for 1bpp
+    uint8_t *mask;    //1 bit per pixel, MSB first. Set where the destination is kept (masked) or drawn (1bpp)
+    uint8_t *tex;     //Texture for the RDP, sprites use VL_N64_TRANSPARENT_INDEX for masked texels. Same as pixels
+                      //for unmasked graphics.
+    bool no_tex;      //Sprite has masked texels that still OR in colour, which the RDP can't reproduce
+    bool uncacheable; //Conversion didn't match the cached model, always use the generic converter
+    bool converting;  //Still being converted on the RSP, until planar_sync
+    int planar_sync;
+    int refs;         //Draws still queued that use the texture; it can't be evicted while non-zero
+    uint32_t last_frame;
+    size_t bytes;
+    struct VL_N64_Gfx *hnext;
+    struct VL_N64_Gfx *lru_prev, *lru_next;
+} VL_N64_Gfx;
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t entries;
+    size_t bytes;
+} VL_N64_GfxCacheStats;
+
+VL_N64_Gfx *VL_N64_GfxCacheGet(VL_N64_GfxKind kind, void *src, int w, int h);
+bool VL_N64_GfxCacheAcquireTex(VL_N64_Gfx *gfx);
+void VL_N64_GfxCacheRelease(VL_N64_Gfx *gfx);
+void VL_N64_GfxCacheNextFrame(void);
+void VL_N64_GfxCacheFlush(void);
+void VL_N64_GfxCacheGetStats(VL_N64_GfxCacheStats *stats);
+void VL_N64_GfxCacheLogStats(void);
+void VL_N64_GfxCacheWait(VL_N64_Gfx *gfx);
+void VL_N64_GfxToPAL8(const VL_N64_Gfx *gfx, uint8_t *dest, int x, int y, int pitch, int dw, int dh, int colour);
+
+//Unmasked and masked graphics of at least this many pixels are converted on the RSP, see id_vl_n64_planar.c.
+//0 keeps every conversion on the CPU.
+#ifndef VL_N64_PLANAR_MIN_PIXELS
+#define VL_N64_PLANAR_MIN_PIXELS 256
+#endif
+
+//Converts plane_bytes of each of the four colour planes at src to 8 CI8 pixels a byte, colour plane n giving bit
+//n. With mask, src starts with a mask plane that's copied there.
+void VL_N64_PlanarToPAL8(const uint8_t *src, int plane_bytes, uint8_t *pixels, uint8_t *mask);
+void VL_N64_PlanarInit(void);
+void VL_N64_PlanarClose(void);
+bool VL_N64_PlanarCanQueue(const void *src, int plane_bytes);
+int VL_N64_PlanarQueue(const uint8_t *src, int plane_bytes, uint8_t *pixels, uint8_t *mask);
+void VL_N64_PlanarWait(int sync);
+
+//The CPU drawing paths use the 64-bit kernels in id_vl_n64_swar.c unless built with VL_N64_SWAR=0, which goes
+//back to the byte at a time loops and the generic VL_*ToPAL8 converters.
+#ifndef VL_N64_SWAR
+#define VL_N64_SWAR 1
+#endif
+
+//Fills w x h pixels at dest with colour, only changing the bits in mapmask
+void VL_N64_RectToPAL8_PM(uint8_t *dest, int pitch, int w, int h, int colour, int mapmask);
+//Draw w x h pixels of a 1bpp image where its bits are set. The image starts bit bits into src, MSB first, and
+//each row starts src_pitch bits after the last. A drawn pixel becomes (pixel & ~mapmask) | (colour & mapmask),
+//or pixel ^ colour.
+void VL_N64_1bppToPAL8_PM(const uint8_t *src, int bit, int src_pitch, uint8_t *dest, int pitch, int w, int h,
+                          int colour, int mapmask);
+void VL_N64_1bppXorWithPAL8(const uint8_t *src, int bit, int src_pitch, uint8_t *dest, int pitch, int w, int h,
+                            int colour);
+
+#endif
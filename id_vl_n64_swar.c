@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// 64-bit versions of the CPU drawing loops that are left after the RDP work. Each 64-bit register holds eight
+// CI8 pixels, so a fill or a map mask merge is a handful of instructions per eight pixels. 1bpp sources are
+// expanded eight bits at a time through a table that turns a source byte into a 0x00/0xFF mask per pixel.
+// The R4300 does unaligned 64-bit loads and stores in two instructions, so rows don't need to be aligned.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "id_vl_n64_private.h"
+
+static uint64_t bits_to_lanes[256];
+
+static void _lanes_init(void)
+{
+    for (int b = 0; b < 256; b++)
+    {
+        //Built a byte at a time so the first pixel is the first byte in memory whatever the endianness
+        uint8_t lanes[8];
+        for (int i = 0; i < 8; i++)
+            lanes[i] = (b & (0x80 >> i)) ? 0xFF : 0x00;
+        memcpy(&bits_to_lanes[b], lanes, sizeof(lanes));
+    }
+}
+
+static inline uint64_t _splat(uint8_t v)
+{
+    return 0x0101010101010101ULL * v;
+}
+
+static inline uint64_t _ld64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void _st64(uint8_t *p, uint64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+//The eight source bits starting at bit, MSB first. Only called for bits that are all inside the source.
+static inline uint8_t _src_byte(const uint8_t *src, int bit)
+{
+    const uint8_t *p = src + (bit >> 3);
+    int s = bit & 7;
+    return s ? (uint8_t)((p[0] << s) | (p[1] >> (8 - s))) : p[0];
+}
+
+//Where a source bit is set the pixel becomes (pixel & ~clear) ^ value. Drawing a colour clears the bits it
+//writes, XOR clears none.
+static void _1bpp_rows(const uint8_t *src, int bit, int src_pitch, uint8_t *dest, int pitch, int w, int h,
+                       uint64_t clear, uint64_t value)
+{
+    if (bits_to_lanes[0xFF] == 0)
+        _lanes_init();
+
+    for (int y = 0; y < h; y++, bit += src_pitch, dest += pitch)
+    {
+        int x = 0;
+        for (; x + 8 <= w; x += 8)
+        {
+            uint64_t m = bits_to_lanes[_src_byte(src, bit + x)];
+            if (m)
+                _st64(dest + x, (_ld64(dest + x) & ~(m & clear)) ^ (m & value));
+        }
+        for (; x < w; x++)
+        {
+            if (src[(bit + x) >> 3] & (0x80 >> ((bit + x) & 7)))
+                dest[x] = (dest[x] & ~(uint8_t)clear) ^ (uint8_t)value;
+        }
+    }
+}
+
+void VL_N64_RectToPAL8_PM(uint8_t *dest, int pitch, int w, int h, int colour, int mapmask)
+{
+    uint8_t keep = ~mapmask;
+    uint8_t set = colour & mapmask;
+    uint64_t keep64 = _splat(keep), set64 = _splat(set);
+    for (int y = 0; y < h; y++, dest += pitch)
+    {
+        uint8_t *p = dest, *end = dest + w;
+        while (p < end && ((uintptr_t)p & 7))
+        {
+            *p = (*p & keep) | set;
+            p++;
+        }
+        for (; p + 8 <= end; p += 8)
+        {
+            _st64(p, (_ld64(p) & keep64) | set64);
+        }
+        for (; p < end; p++)
+        {
+            *p = (*p & keep) | set;
+        }
+    }
+}
+
+void VL_N64_1bppToPAL8_PM(const uint8_t *src, int bit, int src_pitch, uint8_t *dest, int pitch, int w, int h,
+                          int colour, int mapmask)
+{
+    _1bpp_rows(src, bit, src_pitch, dest, pitch, w, h, _splat(mapmask), _splat(colour & mapmask));
+}
+
+void VL_N64_1bppXorWithPAL8(const uint8_t *src, int bit, int src_pitch, uint8_t *dest, int pitch, int w, int h,
+                            int colour)
+{
+    _1bpp_rows(src, bit, src_pitch, dest, pitch, w, h, 0, _splat(colour));
+}
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "imf_songs.h"
+#include "keen_files.h"
+
+//The chunk is a 16-bit byte length followed by 4 byte reg, val, delay records
+static int parse_song(const uint8_t *chunk, uint32_t len, imf_song_t *song)
+{
+    uint32_t bytes = keen_rd16(chunk);
+    song->num_events = ((bytes < len - 2) ? bytes : len - 2) / 4;
+    song->events = malloc(song->num_events * sizeof(imf_event_t));
+    song->ticks = 0;
+    if (song->events == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < song->num_events; i++)
+    {
+        const uint8_t *e = &chunk[2 + i * 4];
+        song->events[i].reg = e[0];
+        song->events[i].val = e[1];
+        song->events[i].delay = keen_rd16(&e[2]);
+        song->ticks += song->events[i].delay;
+    }
+    return 0;
+}
+
+int imf_load_songs(const char *dir, const char *ext, imf_song_t **songs)
+{
+    long info_len, head_len, dict_len, audio_len;
+    uint8_t *info = keen_load_file(dir, "AUDINFOE", ext, &info_len);
+    uint8_t *head = keen_load_file(dir, "AUDIOHHD", ext, &head_len);
+    uint8_t *dict = keen_load_file(dir, "AUDIODCT", ext, &dict_len);
+    uint8_t *audio = keen_load_file(dir, "AUDIO", ext, &audio_len);
+    int num_songs = -1;
+    if (info == NULL || head == NULL || dict == NULL || audio == NULL || info_len < 14 || dict_len < 255 * 4)
+    {
+        goto done;
+    }
+
+    //AUDINFOE starts with the number of songs, the chunk of the first song is its seventh word
+    int count = keen_rd16(&info[0]);
+    int first = keen_rd16(&info[12]);
+    *songs = calloc(count, sizeof(imf_song_t));
+    if (*songs == NULL)
+    {
+        goto done;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int chunk = first + i;
+        if ((chunk + 2) * 4 > head_len)
+        {
+            fprintf(stderr, "song %d is past the end of AUDIOHHD.%s\n", i, ext);
+            goto done;
+        }
+        uint32_t offset = keen_rd32(&head[chunk * 4]);
+        uint32_t end = keen_rd32(&head[(chunk + 1) * 4]);
+        if (end > (uint32_t)audio_len || end < offset + 4)
+        {
+            fprintf(stderr, "song %d is past the end of AUDIO.%s\n", i, ext);
+            goto done;
+        }
+
+        uint32_t expanded = keen_rd32(&audio[offset]);
+        uint8_t *music = malloc(expanded);
+        if (music == NULL || expanded < 2)
+        {
+            free(music);
+            goto done;
+        }
+        keen_huff_expand(&audio[offset + 4], end - offset - 4, music, expanded, dict);
+        int ret = parse_song(music, expanded, &(*songs)[i]);
+        free(music);
+        if (ret < 0)
+        {
+            goto done;
+        }
+    }
+    num_songs = count;
+
+done:
+    free(info);
+    free(head);
+    free(dict);
+    free(audio);
+    return num_songs;
+}
+
+long imf_song_samples(const imf_song_t *song, int rate)
+{
+    return song->ticks * rate / IMF_RATE;
+}
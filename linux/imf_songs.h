@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Loads the AdLib songs out of AUDIO.CKx for the host tools.
+
+#ifndef IMF_SONGS_H
+#define IMF_SONGS_H
+
+#include <stdint.h>
+
+#define IMF_RATE 560 //Keen 4-6 music is sequenced at 560Hz
+
+typedef struct
+{
+    uint8_t reg, val;
+    uint16_t delay;
+} imf_event_t;
+
+typedef struct
+{
+    imf_event_t *events;
+    int num_events;
+    long ticks; //Sum of the delays, the length of the song at IMF_RATE
+} imf_song_t;
+
+//Reads AUDINFOE, AUDIOHHD, AUDIODCT and AUDIO with the extension ext from dir. Returns the number of
+//songs, or -1 after printing why to stderr.
+int imf_load_songs(const char *dir, const char *ext, imf_song_t **songs);
+
+//Samples a song lasts for at rate
+long imf_song_samples(const imf_song_t *song, int rate);
+
+#endif
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host (x86-64 Linux) stand-in for the subset of libdragon used by the Omnispeak64 backends.
+// Only the API surface the id_*_n64.c files call is provided. Graphics calls are headless,
+// audio is paced from the wall clock and timers are polled, so the backends can be run under
+// perf/valgrind without hardware or an emulator. See linux/n64_host.c.
+
+#ifndef __N64_HOST_LIBDRAGON_H__
+#define __N64_HOST_LIBDRAGON_H__
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//n64sys.h
+#define CachedAddr(addr) ((void *)(addr))
+#define UncachedAddr(addr) ((void *)(addr))
+void data_cache_hit_writeback(volatile const void *addr, unsigned long length);
+void data_cache_hit_writeback_invalidate(volatile void *addr, unsigned long length);
+void data_cache_hit_invalidate(volatile void *addr, unsigned long length);
+#define MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+void disable_interrupts(void);
+void enable_interrupts(void);
+
+//interrupt.h
+void register_VI_handler(void (*callback)(void));
+void unregister_VI_handler(void (*callback)(void));
+
+//n64sys.h
+typedef enum
+{
+    TV_TYPE_PAL = 0,
+    TV_TYPE_NTSC = 1,
+    TV_TYPE_MPAL = 2
+} tv_type_t;
+tv_type_t get_tv_type(void);
+
+//debug.h
+#define DEBUG_FEATURE_LOG_ISVIEWER (1 << 0)
+#define DEBUG_FEATURE_ALL 0xFF
+bool debug_init(int features);
+#define debugf(...) fprintf(stderr, __VA_ARGS__)
+
+//dfs.h
+#define DFS_DEFAULT_LOCATION 0x10101000
+#define DFS_ESUCCESS 0
+#define DFS_ENOFILE -2
+int dfs_init(uint32_t base_fs_loc);
+int dfs_open(const char * const path);
+int dfs_size(uint32_t handle);
+int dfs_close(uint32_t handle);
+uint32_t dfs_rom_addr(const char *path);
+
+//dma.h
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_read_raw_async(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_write_raw_async(const void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_wait(void);
+int dma_busy(void);
+
+//timer.h
+#define TF_ONE_SHOT 0
+#define TF_CONTINUOUS 1
+#define TF_DISABLED 2
+#define TICKS_PER_SECOND (93750000 / 2)
+#define TIMER_TICKS_LL(us) ((long long)(us) * 46875LL / 1000LL)
+#define TIMER_TICKS(us) ((int)TIMER_TICKS_LL(us))
+#define TIMER_MICROS_LL(tk) ((long long)(tk) * 1000LL / 46875LL)
+#define TIMER_MICROS(tk) ((int)TIMER_MICROS_LL(tk))
+typedef struct timer_link
+{
+    uint32_t left;
+    uint32_t set;
+    int ovfl;
+    int flags;
+    void (*callback)(int ovfl);
+    struct timer_link *next;
+} timer_link_t;
+void timer_init(void);
+void timer_close(void);
+long long timer_ticks(void);
+timer_link_t *new_timer(int ticks, int flags, void (*callback)(int ovfl));
+void start_timer(timer_link_t *timer, int ticks, int flags, void (*callback)(int ovfl));
+void restart_timer(timer_link_t *timer);
+void stop_timer(timer_link_t *timer);
+void delete_timer(timer_link_t *timer);
+static inline uint32_t get_ticks(void) { return (uint32_t)timer_ticks(); }
+
+//surface.h / display.h
+typedef enum
+{
+    FMT_NONE = 0,
+    FMT_RGBA16 = 1,
+    FMT_RGBA32 = 2,
+    FMT_CI8 = 3,
+    FMT_CI4 = 4,
+} tex_format_t;
+typedef struct surface_s
+{
+    uint16_t flags;
+    uint16_t width;
+    uint16_t height;
+    uint16_t stride;
+    void *buffer;
+} surface_t;
+typedef struct
+{
+    int32_t width;
+    int32_t height;
+    bool interlaced;
+} resolution_t;
+typedef enum { DEPTH_16_BPP, DEPTH_32_BPP } bitdepth_t;
+typedef enum { GAMMA_NONE, GAMMA_CORRECT, GAMMA_CORRECT_DITHER } gamma_t;
+typedef enum
+{
+    ANTIALIAS_OFF,
+    ANTIALIAS_RESAMPLE,
+    ANTIALIAS_RESAMPLE_FETCH_NEEDED,
+    ANTIALIAS_RESAMPLE_FETCH_ALWAYS
+} antialias_t;
+void display_init(resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma_t gamma, antialias_t aa);
+void display_close(void);
+surface_t *display_get(void);
+surface_t *display_try_get(void);
+void display_show(surface_t *surf);
+uint32_t display_get_width(void);
+uint32_t display_get_height(void);
+
+//graphics.h
+typedef struct
+{
+    uint8_t r, g, b, a;
+} color_t;
+#define RGBA32(rx, gx, bx, ax) ((color_t){.r = (rx), .g = (gx), .b = (bx), .a = (ax)})
+#define RGBA16(rx, gx, bx, ax) ((color_t){.r = (rx) << 3, .g = (gx) << 3, .b = (bx) << 3, .a = (ax) ? 0xFF : 0})
+static inline color_t color_from_packed16(uint16_t c)
+{
+    return (color_t){.r = ((c >> 11) & 0x1F) << 3, .g = ((c >> 6) & 0x1F) << 3, .b = ((c >> 1) & 0x1F) << 3,
+                     .a = (c & 0x1) ? 0xFF : 0};
+}
+
+//rdpq.h
+typedef enum { TLUT_NONE = 0, TLUT_RGBA16 = 2, TLUT_IA16 = 3 } rdpq_tlut_t;
+typedef struct
+{
+    int s0, t0;
+    int width, height;
+} rdpq_blitparms_t;
+void rdpq_init(void);
+void rdpq_close(void);
+void rdpq_attach(const surface_t *surf_color, const surface_t *surf_z);
+void rdpq_attach_clear(const surface_t *surf_color, const surface_t *surf_z);
+void rdpq_detach(void);
+void rdpq_detach_show(void);
+void rdpq_detach_wait(void);
+void rdpq_set_scissor(int x0, int y0, int x1, int y1);
+void rdpq_set_fill_color(color_t color);
+void rdpq_set_prim_color(color_t color);
+void rdpq_set_mode_standard(void);
+void rdpq_set_mode_copy(bool transparency);
+void rdpq_set_mode_fill(color_t color);
+void rdpq_mode_tlut(rdpq_tlut_t tlut);
+void rdpq_mode_alphacompare(int threshold);
+void rdpq_fill_rectangle(int x0, int y0, int x1, int y1);
+void rdpq_tex_upload_tlut(uint16_t *tlut, int color_idx, int num_colors);
+void rdpq_tex_blit(const surface_t *surf, float x0, float y0, const rdpq_blitparms_t *parms);
+void rdpq_fence(void);
+
+//audio.h / mixer.h / samplebuffer.h / wav64.h
+#define WAVEFORM_UNKNOWN_LEN 0x7FFFFFFF
+#define WAVEFORM_MAX_LEN 0x1FFFFFFF
+typedef struct samplebuffer_s
+{
+    void *ptr;
+    int wpos;
+    int widx;
+    int size;
+} samplebuffer_t;
+typedef struct waveform_s
+{
+    const char *name;
+    uint8_t channels;
+    uint8_t bits;
+    float frequency;
+    int len;
+    int loop_len;
+    void (*read)(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking);
+    void *ctx;
+} waveform_t;
+void audio_init(const int frequency, int numbuffers);
+void audio_close(void);
+int audio_get_frequency(void);
+int audio_get_buffer_length(void);
+bool audio_can_write(void);
+short *audio_write_begin(void);
+void audio_write_end(void);
+void *samplebuffer_append(samplebuffer_t *buf, int wlen);
+void mixer_init(int num_channels);
+void mixer_close(void);
+void mixer_poll(int16_t *out, int num_samples);
+void mixer_ch_play(int ch, waveform_t *wave);
+void mixer_ch_stop(int ch);
+bool mixer_ch_playing(int ch);
+void mixer_ch_set_vol(int ch, float lvol, float rvol);
+
+//joypad.h
+typedef enum
+{
+    JOYPAD_PORT_1 = 0,
+    JOYPAD_PORT_2 = 1,
+    JOYPAD_PORT_3 = 2,
+    JOYPAD_PORT_4 = 3,
+    JOYPAD_PORT_COUNT = 4
+} joypad_port_t;
+typedef enum
+{
+    JOYPAD_2D_DPAD = (1 << 0),
+    JOYPAD_2D_STICK = (1 << 1),
+    JOYPAD_2D_CSTICK = (1 << 2),
+    JOYPAD_2D_LH = (JOYPAD_2D_DPAD | JOYPAD_2D_STICK),
+    JOYPAD_2D_RH = (JOYPAD_2D_CSTICK),
+    JOYPAD_2D_ANY = (JOYPAD_2D_DPAD | JOYPAD_2D_STICK | JOYPAD_2D_CSTICK)
+} joypad_2d_t;
+typedef enum
+{
+    JOYPAD_8WAY_NONE = -1,
+    JOYPAD_8WAY_RIGHT = 0,
+    JOYPAD_8WAY_UP_RIGHT = 1,
+    JOYPAD_8WAY_UP = 2,
+    JOYPAD_8WAY_UP_LEFT = 3,
+    JOYPAD_8WAY_LEFT = 4,
+    JOYPAD_8WAY_DOWN_LEFT = 5,
+    JOYPAD_8WAY_DOWN = 6,
+    JOYPAD_8WAY_DOWN_RIGHT = 7
+} joypad_8way_t;
+typedef union
+{
+    uint16_t raw;
+    struct __attribute__((packed))
+    {
+        unsigned c_right : 1;
+        unsigned c_left : 1;
+        unsigned c_down : 1;
+        unsigned c_up : 1;
+        unsigned r : 1;
+        unsigned l : 1;
+        unsigned y : 1;
+        unsigned x : 1;
+        unsigned d_right : 1;
+        unsigned d_left : 1;
+        unsigned d_down : 1;
+        unsigned d_up : 1;
+        unsigned start : 1;
+        unsigned z : 1;
+        unsigned b : 1;
+        unsigned a : 1;
+    };
+} joypad_buttons_t;
+typedef struct
+{
+    joypad_buttons_t btn;
+    int8_t stick_x;
+    int8_t stick_y;
+    int8_t cstick_x;
+    int8_t cstick_y;
+    uint8_t analog_l;
+    uint8_t analog_r;
+} joypad_inputs_t;
+void joypad_init(void);
+void joypad_close(void);
+void joypad_poll(void);
+bool joypad_is_connected(joypad_port_t port);
+joypad_inputs_t joypad_get_inputs(joypad_port_t port);
+joypad_buttons_t joypad_get_buttons(joypad_port_t port);
+joypad_buttons_t joypad_get_buttons_pressed(joypad_port_t port);
+joypad_buttons_t joypad_get_buttons_released(joypad_port_t port);
+joypad_buttons_t joypad_get_buttons_held(joypad_port_t port);
+joypad_8way_t joypad_get_direction(joypad_port_t port, joypad_2d_t axes);
+
+#include "system.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
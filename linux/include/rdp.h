@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host stand-in for libdragon's legacy rdp.h. Everything the backends need is declared in libdragon.h.
+
+#ifndef __N64_HOST_RDP_H__
+#define __N64_HOST_RDP_H__
+
+#include "libdragon.h"
+
+#endif
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host stand-in for libdragon's system.h. Filesystems registered with attach_filesystem()
+// are reached through fopen() exactly as on hardware; see __wrap_fopen in linux/n64_host.c.
+
+#ifndef __N64_HOST_SYSTEM_H__
+#define __N64_HOST_SYSTEM_H__
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_FILESYSTEMS 10
+#define MAX_FILESYSTEM_NAME_LEN 15
+
+typedef struct
+{
+    uint32_t d_type;
+    char d_name[256];
+    uint32_t d_size;
+    uint32_t d_cookie;
+} dir_t;
+
+typedef struct
+{
+    void *(*open)(char *name, int flags);
+    int (*fstat)(void *file, struct stat *st);
+    int (*lseek)(void *file, int ptr, int dir);
+    int (*read)(void *file, uint8_t *ptr, int len);
+    int (*write)(void *file, uint8_t *ptr, int len);
+    int (*close)(void *file);
+    int (*unlink)(char *name);
+    int (*findfirst)(char *path, dir_t *dir);
+    int (*findnext)(dir_t *dir);
+} filesystem_t;
+
+int attach_filesystem(const char * const prefix, filesystem_t *filesystem);
+int detach_filesystem(const char * const prefix);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "keen_files.h"
+
+uint8_t *keen_load_file(const char *dir, const char *name, const char *ext, long *size)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(*size);
+    if (data == NULL || fread(data, 1, *size, f) != (size_t)*size)
+    {
+        fprintf(stderr, "can't read %s\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+//255 nodes of two 16-bit links with the head at node 254
+void keen_huff_expand(const uint8_t *src, long src_len, uint8_t *dst, long dst_len, const uint8_t *dict)
+{
+    int node = 254;
+    long out = 0;
+    for (long i = 0; i < src_len && out < dst_len; i++)
+    {
+        for (int bit = 0; bit < 8 && out < dst_len; bit++)
+        {
+            uint16_t code = keen_rd16(&dict[node * 4 + ((src[i] >> bit) & 1) * 2]);
+            if (code < 256)
+            {
+                dst[out++] = (uint8_t)code;
+                node = 254;
+            }
+            else
+            {
+                node = code - 256;
+            }
+        }
+    }
+}
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Reading the game data files for the host tools.
+
+#ifndef KEEN_FILES_H
+#define KEEN_FILES_H
+
+#include <stdint.h>
+
+//Loads dir/name.ext whole. Returns NULL after printing why to stderr.
+uint8_t *keen_load_file(const char *dir, const char *name, const char *ext, long *size);
+
+//Huffman decompression as CAL_HuffExpand, with the 255 node dictionary from AUDIODCT or EGADICT
+void keen_huff_expand(const uint8_t *src, long src_len, uint8_t *dst, long dst_len, const uint8_t *dict);
+
+static inline uint16_t keen_rd16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t keen_rd32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#endif
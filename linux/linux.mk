@@ -0,0 +1,71 @@
+# Host (x86-64 Linux) build of the N64 backends against the libdragon stand-in in linux/.
+# Included from the top level Makefile when TARGET=linux. Produces a headless executable for
+# profiling with perf/valgrind, e.g:
+#   make EP=4 TARGET=linux
+#   N64_HOST_FRAMES=600 ./build-linux/omnispeak64_ep4
+# "rom:/" is served from the same directory the DFS image is made from, pre-rendered music included.
+# There's no RSP, so rsp_planar.S isn't built and id_vl_n64_planar.c converts on the CPU in its place.
+# There is also an OPL synthesis benchmark:
+#   make EP=4 TARGET=linux opl_bench
+#   ./build-linux/opl_bench [song]
+# and an SRAM save/load benchmark:
+#   make EP=4 TARGET=linux sram_bench
+#   ./build-linux/sram_bench
+# and a benchmark of the 64-bit drawing kernels:
+#   make EP=4 TARGET=linux vl_bench
+#   ./build-linux/vl_bench
+
+HOST_DIR = linux
+HOST_SRCS = $(SRCS:%.o=%.c) $(HOST_DIR)/n64_host.c
+HOST_OBJS = $(HOST_SRCS:%.c=$(BUILD_DIR)/%.o)
+
+CFLAGS += -I$(HOST_DIR)/include -g -MMD
+CFLAGS += -DN64_HOST -DHOST_ROM_DIR='"$(DFS_DIR)"'
+CFLAGS += -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast
+LDFLAGS += -Wl,--wrap=fopen -Wl,--wrap=fread
+LDLIBS += -lm
+
+all: $(BUILD_DIR)/$(PROG_NAME) $(DFS_FILES)
+
+$(BUILD_DIR)/$(PROG_NAME): $(HOST_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $^ $(LDLIBS)
+
+BENCH_SRCS = $(HOST_DIR)/opl_bench.c $(HOST_DIR)/imf_songs.c $(HOST_DIR)/keen_files.c id_sd_n64_opl.c $(OMNI_DIR)/opl/dbopl.c
+BENCH_OBJS = $(BENCH_SRCS:%.c=$(BUILD_DIR)/%.o)
+
+opl_bench: $(BUILD_DIR)/opl_bench
+
+$(BUILD_DIR)/$(HOST_DIR)/opl_bench.o: CFLAGS += -I. -DOPL_BENCH_EXT='"CK$(EP)"'
+
+#Plain libc, so no --wrap=fopen
+$(BUILD_DIR)/opl_bench: $(BENCH_OBJS)
+	$(CC) -o $@ $^ $(LDLIBS)
+
+SRAM_BENCH_SRCS = $(HOST_DIR)/sram_bench.c id_fs_n64.c $(HOST_DIR)/n64_host.c
+SRAM_BENCH_OBJS = $(SRAM_BENCH_SRCS:%.c=$(BUILD_DIR)/%.o)
+
+sram_bench: $(BUILD_DIR)/sram_bench
+
+$(BUILD_DIR)/sram_bench: $(SRAM_BENCH_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $^ $(LDLIBS)
+
+#Checked against the real generic converters, so it links with the rest of the game in place of n64_main.c
+VL_BENCH_OBJS = $(BUILD_DIR)/$(HOST_DIR)/vl_bench.o $(filter-out $(BUILD_DIR)/n64_main.o,$(HOST_OBJS))
+
+vl_bench: $(BUILD_DIR)/vl_bench
+
+$(BUILD_DIR)/$(HOST_DIR)/vl_bench.o: CFLAGS += -I.
+
+$(BUILD_DIR)/vl_bench: $(VL_BENCH_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $^ $(LDLIBS)
+
+$(BUILD_DIR)/%.o: %.c
+	@mkdir -p $(dir $@)
+	$(CC) $(CFLAGS) -c -o $@ $<
+
+clean:
+	rm -rf $(BUILD_DIR)
+
+-include $(HOST_OBJS:%.o=%.d) $(BENCH_OBJS:%.o=%.d) $(SRAM_BENCH_OBJS:%.o=%.d) $(VL_BENCH_OBJS:%.o=%.d)
+
+.PHONY: all clean opl_bench sram_bench vl_bench
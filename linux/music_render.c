@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Build time tool that renders every song in AUDIO.CKx through the same OPL path the game uses and writes
+// them out as IMA ADPCM in the format described in id_sd_n64_private.h, for id_sd_n64.c to stream from ROM.
+//   music_render <rom dir> <extension> <output>
+//   music_render filesystem/CK4 CK4 build/filesystem/MUSICPCM.CK4
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "id_sd_n64_private.h"
+#include "imf_songs.h"
+
+#define MUSIC_SAMPLE_RATE 11025 //Same as ADLIB_SAMPLE_RATE in id_sd_n64.c
+
+static void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void wr32(uint8_t *p, uint32_t v)
+{
+    wr16(&p[0], v >> 16);
+    wr16(&p[2], v & 0xFFFF);
+}
+
+//Plays the events from a reset chip, with the register writes falling between the samples of each delay as
+//they do when the t0 timer fills the ring. The song loops back to this state.
+static void render(const imf_song_t *song, int16_t *out)
+{
+    SD_N64_OplInit(MUSIC_SAMPLE_RATE);
+    long pos = 0;
+    uint32_t frac = 0;
+    for (int i = 0; i < song->num_events; i++)
+    {
+        SD_N64_OplWrite(song->events[i].reg, song->events[i].val);
+        frac += song->events[i].delay * MUSIC_SAMPLE_RATE;
+        int len = frac / IMF_RATE;
+        frac %= IMF_RATE;
+        SD_N64_OplGenerate(&out[pos], len);
+        pos += len;
+    }
+}
+
+//Encodes len samples into whole blocks, returning the signal to noise ratio of the round trip in dB
+static double encode(const int16_t *pcm, long len, uint8_t *dst)
+{
+    SD_N64_AdpcmState state = {0, 0};
+    int16_t src[SD_N64_PCM_BLOCK_SAMPLES];
+    int16_t check[SD_N64_PCM_BLOCK_SAMPLES];
+    double signal = 0, noise = 0;
+    for (long pos = 0; pos < len; pos += SD_N64_PCM_BLOCK_SAMPLES)
+    {
+        long n = (len - pos < SD_N64_PCM_BLOCK_SAMPLES) ? len - pos : SD_N64_PCM_BLOCK_SAMPLES;
+        memset(src, 0, sizeof(src));
+        memcpy(src, &pcm[pos], n * sizeof(int16_t));
+        SD_N64_AdpcmEncodeBlock(&state, src, dst);
+        SD_N64_AdpcmDecodeBlock(dst, check);
+        for (int i = 0; i < n; i++)
+        {
+            signal += (double)src[i] * src[i];
+            noise += (double)(src[i] - check[i]) * (src[i] - check[i]);
+        }
+        dst += SD_N64_PCM_BLOCK_BYTES;
+    }
+    return (noise > 0) ? 10 * log10(signal / noise) : INFINITY;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: music_render <rom dir> <extension> <output>\n");
+        return 1;
+    }
+
+    imf_song_t *songs;
+    int num_songs = imf_load_songs(argv[1], argv[2], &songs);
+    if (num_songs < 0)
+    {
+        return 1;
+    }
+
+    FILE *f = fopen(argv[3], "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "music_render: can't create %s\n", argv[3]);
+        return 1;
+    }
+
+    uint8_t header[SD_N64_PCM_HEADER_BYTES];
+    wr32(&header[0], SD_N64_PCM_MAGIC);
+    wr16(&header[4], SD_N64_PCM_VERSION);
+    wr16(&header[6], MUSIC_SAMPLE_RATE);
+    wr16(&header[8], SD_N64_PCM_BLOCK_SAMPLES);
+    wr16(&header[10], num_songs);
+    fwrite(header, 1, sizeof(header), f);
+
+    uint32_t offset = SD_N64_PCM_HEADER_BYTES + num_songs * SD_N64_PCM_SONG_BYTES;
+    for (int i = 0; i < num_songs; i++)
+    {
+        long len = imf_song_samples(&songs[i], MUSIC_SAMPLE_RATE);
+        uint8_t entry[SD_N64_PCM_SONG_BYTES];
+        wr32(&entry[0], offset);
+        wr32(&entry[4], len);
+        fwrite(entry, 1, sizeof(entry), f);
+        offset += (len + SD_N64_PCM_BLOCK_SAMPLES - 1) / SD_N64_PCM_BLOCK_SAMPLES * SD_N64_PCM_BLOCK_BYTES;
+    }
+
+    for (int i = 0; i < num_songs; i++)
+    {
+        long len = imf_song_samples(&songs[i], MUSIC_SAMPLE_RATE);
+        long blocks = (len + SD_N64_PCM_BLOCK_SAMPLES - 1) / SD_N64_PCM_BLOCK_SAMPLES;
+        int16_t *pcm = malloc(len * sizeof(int16_t) + 1);
+        uint8_t *adpcm = malloc(blocks * SD_N64_PCM_BLOCK_BYTES + 1);
+        if (pcm == NULL || adpcm == NULL)
+        {
+            fprintf(stderr, "music_render: out of memory\n");
+            return 1;
+        }
+
+        render(&songs[i], pcm);
+        double snr = encode(pcm, len, adpcm);
+        fwrite(adpcm, 1, blocks * SD_N64_PCM_BLOCK_BYTES, f);
+        printf("song %d: %.1fs, %ld bytes, %.1fdB SNR\n", i, (double)len / MUSIC_SAMPLE_RATE,
+               blocks * SD_N64_PCM_BLOCK_BYTES, snr);
+        free(pcm);
+        free(adpcm);
+    }
+
+    if (ferror(f) || fclose(f) != 0)
+    {
+        fprintf(stderr, "music_render: can't write %s\n", argv[3]);
+        remove(argv[3]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1261 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host (x86-64 Linux) implementation of the libdragon stand-in in linux/include.
+// The game runs headless: display_get() hands out an off-screen framebuffer, rdpq calls are
+// counted (and optionally rasterised), audio buffers are consumed at the real sample rate from the wall
+// clock and timer callbacks are dispatched by polling. SRAM is simulated behind the PI DMA calls
+// so the sramfs code in id_fs_n64.c runs unmodified, and each transfer is charged what it would cost on
+// hardware so the time spent saving and loading can be compared between builds.
+//
+// Environment:
+//   N64_HOST_FRAMES=n   Exit after n presented frames (0 or unset runs forever).
+//   N64_HOST_ROM_DIR=d  Directory served as "rom:/" and as the DFS image on the cartridge (defaults to
+//                       HOST_ROM_DIR from linux.mk).
+//   N64_HOST_SRAM=f     File the simulated SRAM is loaded from and saved to at exit.
+//   N64_HOST_RASTER=1   Rasterise rdpq fills and CI8 blits into the framebuffer in software, so output can
+//                       be checked. A CRC of the last frame is printed at exit.
+//   N64_HOST_TV=pal     Run the VI interrupt at 50Hz like a PAL console instead of 60Hz.
+//   N64_HOST_JOYPAD=s   Port 1 input, as a comma separated list of retrace:buttons[:x:y] where buttons is
+//                       joypad_buttons_t.raw in hex and x, y the stick, held from that retrace until the
+//                       next entry's.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libdragon.h>
+
+#ifndef HOST_ROM_DIR
+#define HOST_ROM_DIR "filesystem/CK4"
+#endif
+
+#define HOST_SRAM_PI_BASE 0x08000000
+#define HOST_ROM_PI_BASE DFS_DEFAULT_LOCATION
+#define HOST_MAX_ROM_FILES 64
+#define HOST_SRAM_SIZE (128 * 1024)
+#define HOST_SRAM_BANK_SIZE (32 * 1024)
+#define HOST_MAX_MIXER_CHANNELS 32
+
+//Cost model for PI DMA to SRAM: a fixed cost per transfer for starting it, waiting on it and the cache
+//maintenance around it, plus the bus time at the domain 2 timings SRAM runs with (roughly 16 RCP cycles,
+//256ns, per 16-bit word)
+#define HOST_PI_DMA_SETUP_NS 2000
+#define HOST_SRAM_NS_PER_BYTE 128
+//Cartridge ROM at libdragon's default domain 1 timings, roughly 5MB/s
+#define HOST_ROM_NS_PER_BYTE 200
+
+//newlib's stdio buffer size on the N64, so filesystems see the same read and write sizes
+#define HOST_STDIO_BUFFER 1024
+
+static uint8_t host_sram[HOST_SRAM_SIZE];
+static long long host_sram_write_budget = -1; //Bytes still written before a simulated power cut, -1 for no cut
+static const char *host_sram_path = NULL;
+
+static struct timespec host_epoch;
+static long long host_frame_limit = 0;
+static bool host_raster = false;
+
+static struct
+{
+    long long frames;
+    long long frame_ticks_max;
+    long long last_frame_ticks;
+    long long rdpq_blits;
+    long long rdpq_fills;
+    long long rdpq_tlut_uploads;
+    long long audio_samples;
+    long long audio_underruns;
+    long long dma_bytes;
+    long long dma_transfers;
+    long long dma_ns;
+} host_stats;
+
+/*
+ * Clock and timers
+ */
+static long long host_now_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long ns = (long long)(ts.tv_sec - host_epoch.tv_sec) * 1000000000LL + (ts.tv_nsec - host_epoch.tv_nsec);
+    return ns * (TICKS_PER_SECOND / 1000) / 1000000LL;
+}
+
+typedef struct
+{
+    timer_link_t *link;
+    long long due;
+    long long period;
+    bool active;
+} host_timer_t;
+
+#define HOST_MAX_TIMERS 16
+static host_timer_t host_timers[HOST_MAX_TIMERS];
+static bool host_in_timer_poll = false;
+
+//The VI interrupt, once per retrace from the wall clock
+#define HOST_MAX_VI_HANDLERS 4
+static void (*host_vi_handlers[HOST_MAX_VI_HANDLERS])(void);
+static long long host_vi_due;
+static long long host_vi_count = 0;
+static tv_type_t host_tv_type = TV_TYPE_NTSC;
+
+static long long host_vi_period(void)
+{
+    return TICKS_PER_SECOND / (host_tv_type == TV_TYPE_PAL ? 50 : 60);
+}
+
+//Real timers fire from the COUNT/COMPARE interrupt. Here overdue timers are dispatched whenever
+//the game touches the clock, audio or display, which is often enough for SDL_t0Service pacing.
+static void host_timer_poll(void)
+{
+    if (host_in_timer_poll)
+    {
+        return;
+    }
+    host_in_timer_poll = true;
+    long long now = host_now_ticks();
+    while (now >= host_vi_due)
+    {
+        host_vi_due += host_vi_period();
+        host_vi_count++;
+        for (int i = 0; i < HOST_MAX_VI_HANDLERS; i++)
+        {
+            if (host_vi_handlers[i])
+            {
+                host_vi_handlers[i]();
+            }
+        }
+    }
+    for (int i = 0; i < HOST_MAX_TIMERS; i++)
+    {
+        host_timer_t *t = &host_timers[i];
+        while (t->link && t->active && now >= t->due)
+        {
+            if (t->link->flags & TF_CONTINUOUS)
+            {
+                t->due += t->period;
+            }
+            else
+            {
+                t->active = false;
+            }
+            if (t->link->callback)
+            {
+                t->link->callback(0);
+            }
+        }
+    }
+    host_in_timer_poll = false;
+}
+
+static host_timer_t *host_find_timer(timer_link_t *timer)
+{
+    for (int i = 0; i < HOST_MAX_TIMERS; i++)
+    {
+        if (host_timers[i].link == timer)
+        {
+            return &host_timers[i];
+        }
+    }
+    return NULL;
+}
+
+void timer_init(void)
+{
+}
+
+void timer_close(void)
+{
+    memset(host_timers, 0, sizeof(host_timers));
+}
+
+long long timer_ticks(void)
+{
+    host_timer_poll();
+    return host_now_ticks();
+}
+
+timer_link_t *new_timer(int ticks, int flags, void (*callback)(int ovfl))
+{
+    timer_link_t *timer = calloc(1, sizeof(timer_link_t));
+    assert(timer != NULL);
+    host_timer_t *slot = host_find_timer(NULL);
+    assert(slot != NULL);
+    slot->link = timer;
+    start_timer(timer, ticks, flags, callback);
+    return timer;
+}
+
+void start_timer(timer_link_t *timer, int ticks, int flags, void (*callback)(int ovfl))
+{
+    host_timer_t *t = host_find_timer(timer);
+    assert(t != NULL);
+    timer->left = ticks;
+    timer->set = ticks;
+    timer->flags = flags;
+    timer->callback = callback;
+    t->period = ticks > 0 ? ticks : 1;
+    t->due = host_now_ticks() + t->period;
+    t->active = !(flags & TF_DISABLED);
+}
+
+void restart_timer(timer_link_t *timer)
+{
+    start_timer(timer, timer->set, timer->flags & ~TF_DISABLED, timer->callback);
+}
+
+void stop_timer(timer_link_t *timer)
+{
+    host_timer_t *t = host_find_timer(timer);
+    if (t)
+    {
+        t->active = false;
+    }
+}
+
+void delete_timer(timer_link_t *timer)
+{
+    host_timer_t *t = host_find_timer(timer);
+    if (t)
+    {
+        memset(t, 0, sizeof(host_timer_t));
+    }
+    free(timer);
+}
+
+/*
+ * System, cache and debug
+ */
+void data_cache_hit_writeback(volatile const void *addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+void data_cache_hit_writeback_invalidate(volatile void *addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+void data_cache_hit_invalidate(volatile void *addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+void disable_interrupts(void)
+{
+}
+
+void enable_interrupts(void)
+{
+}
+
+bool debug_init(int features)
+{
+    (void)features;
+    return true;
+}
+
+int dfs_init(uint32_t base_fs_loc)
+{
+    (void)base_fs_loc;
+    return DFS_ESUCCESS;
+}
+
+/*
+ * Cartridge. Files from the rom directory are placed in the PI ROM window the first time DFS is asked
+ * about them, one after another as mkdfs lays them out, so dma_read() can be pointed at them.
+ */
+typedef struct
+{
+    char name[256];
+    uint32_t rom_addr;
+    uint32_t size;
+    uint8_t *data;
+} host_rom_file_t;
+
+static host_rom_file_t host_rom_files[HOST_MAX_ROM_FILES];
+static int host_num_rom_files = 0;
+static uint32_t host_rom_end = HOST_ROM_PI_BASE;
+
+FILE *__real_fopen(const char *path, const char *mode);
+
+static int host_rom_find(const char *path)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+    for (int i = 0; i < host_num_rom_files; i++)
+    {
+        if (strcmp(host_rom_files[i].name, path) == 0)
+        {
+            return i;
+        }
+    }
+    if (host_num_rom_files == HOST_MAX_ROM_FILES || strlen(path) >= sizeof(host_rom_files[0].name))
+    {
+        return DFS_ENOFILE;
+    }
+
+    const char *rom_dir = getenv("N64_HOST_ROM_DIR");
+    char host_path[512];
+    snprintf(host_path, sizeof(host_path), "%s/%s", rom_dir ? rom_dir : HOST_ROM_DIR, path);
+    FILE *fp = __real_fopen(host_path, "rb");
+    if (fp == NULL)
+    {
+        return DFS_ENOFILE;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *data = malloc(size + 1);
+    assert(data != NULL);
+    if (fread(data, 1, size, fp) != (size_t)size)
+    {
+        free(data);
+        fclose(fp);
+        return DFS_ENOFILE;
+    }
+    fclose(fp);
+
+    host_rom_file_t *f = &host_rom_files[host_num_rom_files];
+    strcpy(f->name, path);
+    f->rom_addr = host_rom_end;
+    f->size = size;
+    f->data = data;
+    host_rom_end = (host_rom_end + size + 1) & ~1;
+    return host_num_rom_files++;
+}
+
+int dfs_open(const char * const path)
+{
+    return host_rom_find(path);
+}
+
+int dfs_size(uint32_t handle)
+{
+    return (handle < (uint32_t)host_num_rom_files) ? (int)host_rom_files[handle].size : DFS_ENOFILE;
+}
+
+int dfs_close(uint32_t handle)
+{
+    (void)handle;
+    return DFS_ESUCCESS;
+}
+
+uint32_t dfs_rom_addr(const char *path)
+{
+    int handle = host_rom_find(path);
+    return (handle < 0) ? 0 : host_rom_files[handle].rom_addr;
+}
+
+/*
+ * PI DMA. The SRAM window and the files placed in the ROM window are backed. Data is copied when a transfer
+ * starts, but dma_busy() stays true for the modelled time of the transfer, so code overlapping DMA with other
+ * work sees it take as long as it would on hardware. Synchronous transfers don't make the host wait;
+ * dma_wait() ends them at once.
+ */
+static long long host_pi_busy_until = 0;
+
+static uint8_t *host_pi_transfer(unsigned long pi_address, unsigned long len)
+{
+    uint8_t *mem = NULL;
+    int ns_per_byte;
+    if (pi_address < HOST_ROM_PI_BASE)
+    {
+        assert(pi_address >= HOST_SRAM_PI_BASE && pi_address - HOST_SRAM_PI_BASE + len <= HOST_SRAM_SIZE);
+        mem = &host_sram[pi_address - HOST_SRAM_PI_BASE];
+        ns_per_byte = HOST_SRAM_NS_PER_BYTE;
+    }
+    else
+    {
+        for (int i = 0; i < host_num_rom_files && mem == NULL; i++)
+        {
+            const host_rom_file_t *f = &host_rom_files[i];
+            if (pi_address >= f->rom_addr && pi_address + len <= f->rom_addr + f->size)
+            {
+                mem = &f->data[pi_address - f->rom_addr];
+            }
+        }
+        assert(mem != NULL);
+        ns_per_byte = HOST_ROM_NS_PER_BYTE;
+    }
+
+    long long ns = HOST_PI_DMA_SETUP_NS + (long long)len * ns_per_byte;
+    host_stats.dma_bytes += len;
+    host_stats.dma_transfers++;
+    host_stats.dma_ns += ns;
+    host_pi_busy_until = host_now_ticks() + ns * (TICKS_PER_SECOND / 1000) / 1000000LL;
+    return mem;
+}
+
+static uint8_t *host_pi_to_ram(const void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    //The alignment the PI needs
+    assert(((uintptr_t)ram_address & 7) == 0);
+    assert((pi_address & 1) == 0);
+    assert(pi_address >= HOST_ROM_PI_BASE || len == 0 ||
+           (pi_address - HOST_SRAM_PI_BASE) / HOST_SRAM_BANK_SIZE ==
+           (pi_address - HOST_SRAM_PI_BASE + len - 1) / HOST_SRAM_BANK_SIZE);
+    return host_pi_transfer(pi_address, len);
+}
+
+void dma_read_raw_async(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    memcpy(ram_address, host_pi_to_ram(ram_address, pi_address, len), len);
+}
+
+//Any alignment, like libdragon's, which bounces the ends through the PI-mapped window as needed
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    memcpy(ram_address, host_pi_transfer(pi_address, len), len);
+    dma_wait();
+}
+
+void dma_write_raw_async(const void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    uint8_t *sram = host_pi_to_ram(ram_address, pi_address, len);
+    if (host_sram_write_budget >= 0)
+    {
+        len = (len < host_sram_write_budget) ? len : host_sram_write_budget;
+        host_sram_write_budget -= len;
+    }
+    memcpy(sram, ram_address, len);
+}
+
+//For the host benchmarks: SRAM stops taking writes after bytes more have been written, as if the power
+//was cut. -1 restores it.
+void host_sram_cut_power_after(long long bytes)
+{
+    host_sram_write_budget = bytes;
+}
+
+//For the host benchmarks: PI DMA done so far and its modelled time on hardware
+void host_pi_get_stats(long long *transfers, long long *bytes, long long *ns)
+{
+    *transfers = host_stats.dma_transfers;
+    *bytes = host_stats.dma_bytes;
+    *ns = host_stats.dma_ns;
+}
+
+void dma_wait(void)
+{
+    host_pi_busy_until = 0;
+}
+
+int dma_busy(void)
+{
+    return host_now_ticks() < host_pi_busy_until;
+}
+
+void register_VI_handler(void (*callback)(void))
+{
+    for (int i = 0; i < HOST_MAX_VI_HANDLERS; i++)
+    {
+        if (host_vi_handlers[i] == NULL)
+        {
+            host_vi_handlers[i] = callback;
+            return;
+        }
+    }
+    assert(0);
+}
+
+void unregister_VI_handler(void (*callback)(void))
+{
+    for (int i = 0; i < HOST_MAX_VI_HANDLERS; i++)
+    {
+        if (host_vi_handlers[i] == callback)
+        {
+            host_vi_handlers[i] = NULL;
+        }
+    }
+}
+
+tv_type_t get_tv_type(void)
+{
+    return host_tv_type;
+}
+
+/*
+ * Display and RDP
+ */
+#define HOST_MAX_DISPLAY_BUFFERS 3
+
+//display_get() hands out the buffers in turn, like libdragon does once the previous one has been shown
+static surface_t host_displays[HOST_MAX_DISPLAY_BUFFERS];
+static int host_num_displays = 0;
+static int host_display_next = 0;
+
+void display_init(resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma_t gamma, antialias_t aa)
+{
+    (void)bit;
+    (void)gamma;
+    (void)aa;
+    display_close();
+    assert(num_buffers >= 1 && num_buffers <= HOST_MAX_DISPLAY_BUFFERS);
+    for (uint32_t i = 0; i < num_buffers; i++)
+    {
+        surface_t *d = &host_displays[i];
+        d->flags = FMT_RGBA16;
+        d->width = res.width;
+        d->height = res.height;
+        d->stride = res.width * sizeof(uint16_t);
+        d->buffer = calloc(res.width * res.height, sizeof(uint16_t));
+        assert(d->buffer != NULL);
+    }
+    host_num_displays = num_buffers;
+    host_display_next = 0;
+}
+
+void display_close(void)
+{
+    for (int i = 0; i < host_num_displays; i++)
+    {
+        free(host_displays[i].buffer);
+    }
+    memset(host_displays, 0, sizeof(host_displays));
+    host_num_displays = 0;
+}
+
+surface_t *display_get(void)
+{
+    host_timer_poll();
+    return host_num_displays ? &host_displays[host_display_next] : NULL;
+}
+
+surface_t *display_try_get(void)
+{
+    return display_get();
+}
+
+uint32_t display_get_width(void)
+{
+    return host_displays[0].width;
+}
+
+uint32_t display_get_height(void)
+{
+    return host_displays[0].height;
+}
+
+void display_show(surface_t *surf)
+{
+    assert(surf == &host_displays[host_display_next]);
+    host_display_next = (host_display_next + 1) % host_num_displays;
+    long long now = host_now_ticks();
+    if (host_stats.frames > 0 && now - host_stats.last_frame_ticks > host_stats.frame_ticks_max)
+    {
+        host_stats.frame_ticks_max = now - host_stats.last_frame_ticks;
+    }
+    host_stats.last_frame_ticks = now;
+    host_stats.frames++;
+    if (host_frame_limit > 0 && host_stats.frames >= host_frame_limit)
+    {
+        exit(0);
+    }
+}
+
+static struct
+{
+    const surface_t *target;
+    uint16_t tlut[256];
+    uint16_t fill;
+    bool fill_mode;
+    bool alpha_compare;
+    int sx0, sy0, sx1, sy1;
+} host_rdp;
+
+static uint16_t host_rgba16(color_t c)
+{
+    return ((c.r >> 3) << 11) | ((c.g >> 3) << 6) | ((c.b >> 3) << 1) | (c.a >> 7);
+}
+
+static void host_rdp_pixel(int x, int y, uint16_t c)
+{
+    const surface_t *t = host_rdp.target;
+    if (t == NULL || x < host_rdp.sx0 || y < host_rdp.sy0 || x >= host_rdp.sx1 || y >= host_rdp.sy1 ||
+        x >= t->width || y >= t->height)
+    {
+        return;
+    }
+    ((uint16_t *)t->buffer)[y * (t->stride / 2) + x] = c;
+}
+
+void rdpq_init(void)
+{
+}
+
+void rdpq_close(void)
+{
+}
+
+void rdpq_attach(const surface_t *surf_color, const surface_t *surf_z)
+{
+    (void)surf_z;
+    host_rdp.target = surf_color;
+    host_rdp.sx0 = host_rdp.sy0 = 0;
+    host_rdp.sx1 = surf_color->width;
+    host_rdp.sy1 = surf_color->height;
+}
+
+void rdpq_attach_clear(const surface_t *surf_color, const surface_t *surf_z)
+{
+    rdpq_attach(surf_color, surf_z);
+    if (host_raster)
+    {
+        memset(surf_color->buffer, 0, surf_color->stride * surf_color->height);
+    }
+    host_stats.rdpq_fills++;
+}
+
+static const surface_t *host_last_target;
+
+void rdpq_detach(void)
+{
+    host_last_target = host_rdp.target;
+    host_rdp.target = NULL;
+}
+
+void rdpq_detach_wait(void)
+{
+    rdpq_detach();
+}
+
+void rdpq_detach_show(void)
+{
+    rdpq_detach();
+    display_show((surface_t *)host_last_target);
+}
+
+void rdpq_set_scissor(int x0, int y0, int x1, int y1)
+{
+    host_rdp.sx0 = x0;
+    host_rdp.sy0 = y0;
+    host_rdp.sx1 = x1;
+    host_rdp.sy1 = y1;
+}
+
+void rdpq_set_fill_color(color_t color)
+{
+    host_rdp.fill = host_rgba16(color);
+}
+
+void rdpq_set_prim_color(color_t color)
+{
+    (void)color;
+}
+
+void rdpq_set_mode_standard(void)
+{
+    host_rdp.fill_mode = false;
+    host_rdp.alpha_compare = false;
+}
+
+void rdpq_set_mode_copy(bool transparency)
+{
+    host_rdp.fill_mode = false;
+    host_rdp.alpha_compare = transparency;
+}
+
+void rdpq_set_mode_fill(color_t color)
+{
+    host_rdp.fill_mode = true;
+    rdpq_set_fill_color(color);
+}
+
+void rdpq_mode_tlut(rdpq_tlut_t tlut)
+{
+    (void)tlut;
+}
+
+void rdpq_mode_alphacompare(int threshold)
+{
+    host_rdp.alpha_compare = threshold > 0;
+}
+
+void rdpq_fill_rectangle(int x0, int y0, int x1, int y1)
+{
+    host_stats.rdpq_fills++;
+    if (!host_raster)
+    {
+        return;
+    }
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            host_rdp_pixel(x, y, host_rdp.fill);
+        }
+    }
+}
+
+void rdpq_tex_upload_tlut(uint16_t *tlut, int color_idx, int num_colors)
+{
+    memcpy(&host_rdp.tlut[color_idx], tlut, num_colors * sizeof(uint16_t));
+    host_stats.rdpq_tlut_uploads++;
+}
+
+void rdpq_tex_blit(const surface_t *surf, float x0, float y0, const rdpq_blitparms_t *parms)
+{
+    host_stats.rdpq_blits++;
+    if (!host_raster || surf->flags != FMT_CI8)
+    {
+        return;
+    }
+    int s0 = parms ? parms->s0 : 0;
+    int t0 = parms ? parms->t0 : 0;
+    int w = (parms && parms->width) ? parms->width : surf->width - s0;
+    int h = (parms && parms->height) ? parms->height : surf->height - t0;
+    for (int t = 0; t < h; t++)
+    {
+        const uint8_t *row = (const uint8_t *)surf->buffer + (t0 + t) * surf->stride + s0;
+        for (int s = 0; s < w; s++)
+        {
+            uint16_t c = host_rdp.tlut[row[s]];
+            if (host_rdp.alpha_compare && !(c & 1))
+            {
+                continue;
+            }
+            host_rdp_pixel((int)x0 + s, (int)y0 + t, c);
+        }
+    }
+}
+
+void rdpq_fence(void)
+{
+}
+
+/*
+ * Audio and mixer. Buffers drain at the configured frequency in wall-clock time.
+ */
+static int host_audio_frequency;
+static int host_audio_num_buffers;
+static int host_audio_buffer_len;
+static int16_t *host_audio_buffer;
+static long long host_audio_written;
+static long long host_audio_start_ticks;
+
+void audio_init(const int frequency, int numbuffers)
+{
+    host_audio_frequency = frequency;
+    host_audio_num_buffers = numbuffers;
+    host_audio_buffer_len = ((frequency / 25) + 7) & ~7;
+    host_audio_buffer = calloc(host_audio_buffer_len * 2, sizeof(int16_t));
+    assert(host_audio_buffer != NULL);
+    host_audio_written = 0;
+    host_audio_start_ticks = host_now_ticks();
+}
+
+void audio_close(void)
+{
+    free(host_audio_buffer);
+    host_audio_buffer = NULL;
+    host_audio_frequency = 0;
+}
+
+int audio_get_frequency(void)
+{
+    return host_audio_frequency;
+}
+
+int audio_get_buffer_length(void)
+{
+    return host_audio_buffer_len;
+}
+
+bool audio_can_write(void)
+{
+    if (host_audio_buffer == NULL)
+    {
+        return false;
+    }
+    host_timer_poll();
+    long long played = (host_now_ticks() - host_audio_start_ticks) * host_audio_frequency / TICKS_PER_SECOND;
+    if (host_audio_written < played)
+    {
+        //Every buffer drained before the game refilled them, the gap plays as silence
+        host_stats.audio_underruns++;
+        host_audio_written = played;
+    }
+    return host_audio_written < played + (long long)host_audio_num_buffers * host_audio_buffer_len;
+}
+
+short *audio_write_begin(void)
+{
+    return host_audio_buffer;
+}
+
+void audio_write_end(void)
+{
+    host_audio_written += host_audio_buffer_len;
+}
+
+typedef struct
+{
+    waveform_t *wave;
+    samplebuffer_t sbuf;
+    int wpos;
+    float lvol, rvol;
+} host_mixer_channel_t;
+
+static host_mixer_channel_t host_mixer_channels[HOST_MAX_MIXER_CHANNELS];
+static int host_mixer_num_channels;
+
+void *samplebuffer_append(samplebuffer_t *buf, int wlen)
+{
+    int bytes = wlen * 4;
+    if (bytes > buf->size)
+    {
+        buf->ptr = realloc(buf->ptr, bytes);
+        assert(buf->ptr != NULL);
+        buf->size = bytes;
+    }
+    buf->widx = wlen;
+    return buf->ptr;
+}
+
+void mixer_init(int num_channels)
+{
+    assert(num_channels <= HOST_MAX_MIXER_CHANNELS);
+    host_mixer_num_channels = num_channels;
+    for (int i = 0; i < num_channels; i++)
+    {
+        host_mixer_channels[i].lvol = 1.0f;
+        host_mixer_channels[i].rvol = 1.0f;
+    }
+}
+
+void mixer_close(void)
+{
+    for (int i = 0; i < host_mixer_num_channels; i++)
+    {
+        free(host_mixer_channels[i].sbuf.ptr);
+    }
+    memset(host_mixer_channels, 0, sizeof(host_mixer_channels));
+    host_mixer_num_channels = 0;
+}
+
+void mixer_ch_play(int ch, waveform_t *wave)
+{
+    assert(ch < host_mixer_num_channels);
+    host_mixer_channels[ch].wave = wave;
+    host_mixer_channels[ch].wpos = 0;
+}
+
+void mixer_ch_stop(int ch)
+{
+    host_mixer_channels[ch].wave = NULL;
+}
+
+bool mixer_ch_playing(int ch)
+{
+    return host_mixer_channels[ch].wave != NULL;
+}
+
+void mixer_ch_set_vol(int ch, float lvol, float rvol)
+{
+    host_mixer_channels[ch].lvol = lvol;
+    host_mixer_channels[ch].rvol = rvol;
+}
+
+//Nearest-neighbour resample of every playing channel into interleaved stereo. Waveforms are
+//pulled through their read callbacks like the real mixer, so the generation cost is identical.
+void mixer_poll(int16_t *out, int num_samples)
+{
+    memset(out, 0, num_samples * 2 * sizeof(int16_t));
+    for (int ch = 0; ch < host_mixer_num_channels; ch++)
+    {
+        host_mixer_channel_t *c = &host_mixer_channels[ch];
+        waveform_t *w = c->wave;
+        if (w == NULL || w->read == NULL || host_audio_frequency == 0)
+        {
+            continue;
+        }
+        int wlen = (int)((long long)num_samples * (int)w->frequency / host_audio_frequency);
+        if (wlen <= 0)
+        {
+            continue;
+        }
+        w->read(w->ctx, &c->sbuf, c->wpos, wlen, false);
+        c->wpos += wlen;
+        if (w->bits != 16)
+        {
+            continue;
+        }
+        int16_t *src = c->sbuf.ptr;
+        for (int i = 0; i < num_samples; i++)
+        {
+            int si = (int)((long long)i * wlen / num_samples) * w->channels;
+            int l = out[i * 2 + 0] + (int)(src[si] * c->lvol);
+            int r = out[i * 2 + 1] + (int)(src[si + w->channels - 1] * c->rvol);
+            out[i * 2 + 0] = l > 32767 ? 32767 : (l < -32768 ? -32768 : l);
+            out[i * 2 + 1] = r > 32767 ? 32767 : (r < -32768 ? -32768 : r);
+        }
+    }
+    host_stats.audio_samples += num_samples;
+}
+
+/*
+ * Joypad. Port 1 is connected, with the buttons from N64_HOST_JOYPAD or nothing pressed.
+ */
+#define HOST_MAX_JOYPAD_STEPS 256
+
+static struct
+{
+    long long vi;
+    joypad_inputs_t inputs;
+} host_joypad_script[HOST_MAX_JOYPAD_STEPS];
+static int host_joypad_steps = 0;
+
+static void host_joypad_load(const char *script)
+{
+    while (script && *script && host_joypad_steps < HOST_MAX_JOYPAD_STEPS)
+    {
+        long long vi;
+        unsigned buttons;
+        int x = 0, y = 0;
+        if (sscanf(script, "%lld:%x:%d:%d", &vi, &buttons, &x, &y) < 2)
+        {
+            break;
+        }
+        joypad_inputs_t *inputs = &host_joypad_script[host_joypad_steps].inputs;
+        host_joypad_script[host_joypad_steps].vi = vi;
+        inputs->btn.raw = buttons;
+        inputs->stick_x = x;
+        inputs->stick_y = y;
+        host_joypad_steps++;
+        script = strchr(script, ',');
+        script = script ? script + 1 : NULL;
+    }
+}
+
+void joypad_init(void)
+{
+}
+
+void joypad_close(void)
+{
+}
+
+void joypad_poll(void)
+{
+    host_timer_poll();
+}
+
+bool joypad_is_connected(joypad_port_t port)
+{
+    return port == JOYPAD_PORT_1;
+}
+
+joypad_inputs_t joypad_get_inputs(joypad_port_t port)
+{
+    joypad_inputs_t inputs = {0};
+    for (int i = 0; port == JOYPAD_PORT_1 && i < host_joypad_steps && host_joypad_script[i].vi <= host_vi_count; i++)
+    {
+        inputs = host_joypad_script[i].inputs;
+    }
+    return inputs;
+}
+
+joypad_buttons_t joypad_get_buttons(joypad_port_t port)
+{
+    return joypad_get_inputs(port).btn;
+}
+
+joypad_buttons_t joypad_get_buttons_pressed(joypad_port_t port)
+{
+    return joypad_get_buttons(port);
+}
+
+joypad_buttons_t joypad_get_buttons_released(joypad_port_t port)
+{
+    return joypad_get_buttons(port);
+}
+
+joypad_buttons_t joypad_get_buttons_held(joypad_port_t port)
+{
+    return joypad_get_buttons(port);
+}
+
+//Only the d-pad
+joypad_8way_t joypad_get_direction(joypad_port_t port, joypad_2d_t axes)
+{
+    joypad_buttons_t b = joypad_get_buttons(port);
+    int x = b.d_right - b.d_left, y = b.d_up - b.d_down;
+    if (!(axes & JOYPAD_2D_DPAD) || (x == 0 && y == 0))
+    {
+        return JOYPAD_8WAY_NONE;
+    }
+    static const joypad_8way_t dirs[3][3] = {
+        {JOYPAD_8WAY_DOWN_LEFT, JOYPAD_8WAY_DOWN, JOYPAD_8WAY_DOWN_RIGHT},
+        {JOYPAD_8WAY_LEFT, JOYPAD_8WAY_NONE, JOYPAD_8WAY_RIGHT},
+        {JOYPAD_8WAY_UP_LEFT, JOYPAD_8WAY_UP, JOYPAD_8WAY_UP_RIGHT},
+    };
+    return dirs[y + 1][x + 1];
+}
+
+/*
+ * Filesystems. libdragon hooks newlib so fopen("sram:/...") reaches the attached filesystem_t.
+ * The host build links with -Wl,--wrap=fopen and does the same through fopencookie().
+ */
+#include <stdio_ext.h>
+
+typedef struct
+{
+    char prefix[MAX_FILESYSTEM_NAME_LEN + 1];
+    filesystem_t *fs;
+} host_fs_link_t;
+
+static host_fs_link_t host_filesystems[MAX_FILESYSTEMS];
+
+typedef struct host_fs_cookie
+{
+    filesystem_t *fs;
+    void *handle;
+    FILE *fp;
+    struct host_fs_cookie *next;
+} host_fs_cookie_t;
+
+static host_fs_cookie_t *host_fs_open_cookies = NULL;
+
+int attach_filesystem(const char * const prefix, filesystem_t *filesystem)
+{
+    if (prefix == NULL || filesystem == NULL || strlen(prefix) > MAX_FILESYSTEM_NAME_LEN)
+    {
+        return -1;
+    }
+    for (int i = 0; i < MAX_FILESYSTEMS; i++)
+    {
+        if (host_filesystems[i].fs == NULL)
+        {
+            strcpy(host_filesystems[i].prefix, prefix);
+            host_filesystems[i].fs = filesystem;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int detach_filesystem(const char * const prefix)
+{
+    for (int i = 0; i < MAX_FILESYSTEMS; i++)
+    {
+        if (host_filesystems[i].fs && strcmp(host_filesystems[i].prefix, prefix) == 0)
+        {
+            host_filesystems[i].fs = NULL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static ssize_t host_fs_read(void *cookie, char *buf, size_t size)
+{
+    host_fs_cookie_t *c = cookie;
+    return c->fs->read ? c->fs->read(c->handle, (uint8_t *)buf, (int)size) : -1;
+}
+
+static ssize_t host_fs_write(void *cookie, const char *buf, size_t size)
+{
+    host_fs_cookie_t *c = cookie;
+    return c->fs->write ? c->fs->write(c->handle, (uint8_t *)buf, (int)size) : -1;
+}
+
+static int host_fs_seek(void *cookie, off64_t *offset, int whence)
+{
+    host_fs_cookie_t *c = cookie;
+    if (c->fs->lseek == NULL)
+    {
+        return -1;
+    }
+    int pos = c->fs->lseek(c->handle, (int)*offset, whence);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    *offset = pos;
+    return 0;
+}
+
+static int host_fs_close(void *cookie)
+{
+    host_fs_cookie_t *c = cookie;
+    int ret = c->fs->close ? c->fs->close(c->handle) : 0;
+    for (host_fs_cookie_t **p = &host_fs_open_cookies; *p; p = &(*p)->next)
+    {
+        if (*p == c)
+        {
+            *p = c->next;
+            break;
+        }
+    }
+    free(c);
+    return ret;
+}
+
+size_t __real_fread(void *ptr, size_t size, size_t nmemb, FILE *fp);
+
+//newlib hands a read from an unbuffered stream to the filesystem whole, glibc's fopencookie streams ask for
+//it a byte at a time. The host build links with -Wl,--wrap=fread to read the newlib way.
+size_t __wrap_fread(void *ptr, size_t size, size_t nmemb, FILE *fp)
+{
+    host_fs_cookie_t *c = host_fs_open_cookies;
+    while (c && c->fp != fp)
+    {
+        c = c->next;
+    }
+    if (c == NULL || c->fs->read == NULL || size == 0 || __fbufsize(fp) > 1 || fp->_IO_read_ptr != fp->_IO_read_end)
+    {
+        return __real_fread(ptr, size, nmemb, fp);
+    }
+
+    size_t want = size * nmemb, got = 0;
+    while (got < want)
+    {
+        int n = c->fs->read(c->handle, (uint8_t *)ptr + got, (int)(want - got));
+        if (n <= 0)
+        {
+            //Let stdio see the end of the file too
+            getc(fp);
+            break;
+        }
+        got += n;
+    }
+    return got / size;
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+    if (strncmp(path, "rom:/", 5) == 0)
+    {
+        const char *rom_dir = getenv("N64_HOST_ROM_DIR");
+        char host_path[512];
+        snprintf(host_path, sizeof(host_path), "%s/%s", rom_dir ? rom_dir : HOST_ROM_DIR, path + 5);
+        return __real_fopen(host_path, mode);
+    }
+
+    for (int i = 0; i < MAX_FILESYSTEMS; i++)
+    {
+        host_fs_link_t *link = &host_filesystems[i];
+        size_t prefix_len = strlen(link->prefix);
+        if (link->fs == NULL || strncmp(path, link->prefix, prefix_len) != 0)
+        {
+            continue;
+        }
+
+        int flags = O_RDONLY;
+        if (mode[0] == 'w')
+        {
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        }
+        else if (mode[0] == 'a')
+        {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+        }
+        if (strchr(mode, '+'))
+        {
+            flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+        }
+
+        //Same as libdragon: the callback gets the path from the '/' that ends the prefix
+        void *handle = link->fs->open((char *)path + prefix_len - 1, flags);
+        if (handle == NULL)
+        {
+            return NULL;
+        }
+        host_fs_cookie_t *cookie = malloc(sizeof(host_fs_cookie_t));
+        assert(cookie != NULL);
+        cookie->fs = link->fs;
+        cookie->handle = handle;
+        cookie->next = host_fs_open_cookies;
+        cookie_io_functions_t io = {
+            .read = host_fs_read,
+            .write = host_fs_write,
+            .seek = host_fs_seek,
+            .close = host_fs_close
+        };
+        FILE *fp = fopencookie(cookie, mode, io);
+        if (fp != NULL)
+        {
+            setvbuf(fp, NULL, _IOFBF, HOST_STDIO_BUFFER);
+            cookie->fp = fp;
+            host_fs_open_cookies = cookie;
+        }
+        else
+        {
+            host_fs_close(cookie);
+        }
+        return fp;
+    }
+    return __real_fopen(path, mode);
+}
+
+/*
+ * Startup and shutdown
+ */
+static void host_shutdown(void)
+{
+    if (host_sram_path)
+    {
+        FILE *fp = __real_fopen(host_sram_path, "wb");
+        if (fp)
+        {
+            fwrite(host_sram, 1, sizeof(host_sram), fp);
+            fclose(fp);
+        }
+    }
+
+    long long ticks = host_now_ticks();
+    double secs = (double)ticks / TICKS_PER_SECOND;
+    fprintf(stderr, "n64_host: %lld frames in %.2fs (%.2f fps, max frame %.2fms)\n",
+            host_stats.frames, secs, secs > 0 ? host_stats.frames / secs : 0.0,
+            TIMER_MICROS_LL(host_stats.frame_ticks_max) / 1000.0);
+    fprintf(stderr, "n64_host: rdpq %lld blits, %lld fills, %lld tlut uploads\n",
+            host_stats.rdpq_blits, host_stats.rdpq_fills, host_stats.rdpq_tlut_uploads);
+    fprintf(stderr, "n64_host: audio %lld samples / %lld underruns, pi dma %lld transfers / %lld bytes (%.2fms on hardware)\n",
+            host_stats.audio_samples, host_stats.audio_underruns, host_stats.dma_transfers, host_stats.dma_bytes,
+            host_stats.dma_ns / 1e6);
+    if (host_raster && host_num_displays)
+    {
+        //FNV-1a of the last frame shown, for comparing output between builds
+        const surface_t *d = &host_displays[(host_display_next + host_num_displays - 1) % host_num_displays];
+        uint32_t crc = 2166136261u;
+        const uint8_t *p = (const uint8_t *)d->buffer;
+        for (int i = 0; i < d->width * d->height * 2; i++)
+        {
+            crc = (crc ^ p[i]) * 16777619u;
+        }
+        fprintf(stderr, "n64_host: last frame hash %08x\n", crc);
+    }
+}
+
+__attribute__((constructor)) static void host_startup(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &host_epoch);
+
+    const char *frames = getenv("N64_HOST_FRAMES");
+    host_frame_limit = frames ? atoll(frames) : 0;
+    host_raster = getenv("N64_HOST_RASTER") != NULL;
+    const char *tv = getenv("N64_HOST_TV");
+    host_tv_type = (tv && strcmp(tv, "pal") == 0) ? TV_TYPE_PAL : TV_TYPE_NTSC;
+    host_joypad_load(getenv("N64_HOST_JOYPAD"));
+
+    host_sram_path = getenv("N64_HOST_SRAM");
+    if (host_sram_path)
+    {
+        FILE *fp = __real_fopen(host_sram_path, "rb");
+        if (fp)
+        {
+            fread(host_sram, 1, sizeof(host_sram), fp);
+            fclose(fp);
+        }
+    }
+    atexit(host_shutdown);
+}
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host benchmark for the OPL path in id_sd_n64_opl.c. Renders a song from AUDIO.CKx twice: through DBOPL
+// the way music_read used to (a VLA of 32-bit samples per call, narrowed one at a time) and through
+// SD_N64_OplGenerate, then reports samples per second for each and how many output samples differ.
+//   make EP=4 TARGET=linux opl_bench
+//   ./build-linux/opl_bench [song] [rom dir]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "opl/dbopl.h"
+#include "id_sd_n64_private.h"
+#include "imf_songs.h"
+
+#define BENCH_SAMPLE_RATE 11025 //Same as ADLIB_SAMPLE_RATE in id_sd_n64.c
+#define BENCH_PASSES 3
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//How music_read generated samples before
+static void generate_old(Chip *chip, int16_t *dst, int wlen)
+{
+    int32_t _data[wlen];
+    Chip__GenerateBlock2(chip, wlen, _data);
+    for (int i = 0; i < wlen; i++)
+    {
+        dst[i] = (int16_t)(_data[i]);
+    }
+}
+
+//Plays the events with the register writes falling between the samples of each delay
+static double render(const imf_event_t *events, int num_events, int16_t *out, bool old)
+{
+    static Chip chip;
+    if (old)
+    {
+        DBOPL_InitTables();
+        Chip__Chip(&chip);
+        Chip__Setup(&chip, BENCH_SAMPLE_RATE);
+    }
+    else
+    {
+        SD_N64_OplInit(BENCH_SAMPLE_RATE);
+    }
+
+    double start = now_seconds();
+    long pos = 0;
+    uint32_t frac = 0;
+    for (int i = 0; i < num_events; i++)
+    {
+        if (old)
+            Chip__WriteReg(&chip, events[i].reg, events[i].val);
+        else
+            SD_N64_OplWrite(events[i].reg, events[i].val);
+
+        frac += events[i].delay * BENCH_SAMPLE_RATE;
+        int len = frac / IMF_RATE;
+        frac %= IMF_RATE;
+        if (len == 0)
+            continue;
+        if (old)
+            generate_old(&chip, &out[pos], len);
+        else
+            SD_N64_OplGenerate(&out[pos], len);
+        pos += len;
+    }
+    return now_seconds() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int song = (argc > 1) ? atoi(argv[1]) : 0;
+    const char *dir = (argc > 2) ? argv[2] : HOST_ROM_DIR;
+
+    imf_song_t *songs;
+    int num_songs = imf_load_songs(dir, OPL_BENCH_EXT, &songs);
+    if (num_songs < 0)
+    {
+        return 1;
+    }
+    if (song < 0 || song >= num_songs)
+    {
+        fprintf(stderr, "opl_bench: song must be 0 to %d\n", num_songs - 1);
+        return 1;
+    }
+    const imf_event_t *events = songs[song].events;
+    int num_events = songs[song].num_events;
+    long total = imf_song_samples(&songs[song], BENCH_SAMPLE_RATE);
+
+    int16_t *out_old = calloc(total, sizeof(int16_t));
+    int16_t *out_new = calloc(total, sizeof(int16_t));
+    double best_old = 1e9, best_new = 1e9;
+    for (int pass = 0; pass < BENCH_PASSES; pass++)
+    {
+        double t = render(events, num_events, out_old, true);
+        best_old = (t < best_old) ? t : best_old;
+        t = render(events, num_events, out_new, false);
+        best_new = (t < best_new) ? t : best_new;
+    }
+
+    long differ = 0;
+    for (long i = 0; i < total; i++)
+    {
+        differ += (out_old[i] != out_new[i]);
+    }
+    SD_N64_OplStats stats;
+    SD_N64_OplGetStats(&stats);
+
+    printf("song %d: %d events, %ld samples (%.1fs at %dHz)\n", song, num_events, total,
+           (double)total / BENCH_SAMPLE_RATE, BENCH_SAMPLE_RATE);
+    printf("before: %.0f samples/s\n", total / best_old);
+    printf("after:  %.0f samples/s (x%.2f)\n", total / best_new, best_old / best_new);
+    printf("after: %u generated, %u skipped while idle, %u clipped, %ld samples differ from before\n",
+           stats.generated, stats.skipped, stats.clipped, differ);
+    return 0;
+}
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host benchmark for the SRAM filesystem in id_fs_n64.c. Writes a save to blank SRAM through stdio in the
+// small pieces the engine uses, then reads it back, and reports the PI DMA each step needed along with its
+// time on hardware from the cost model in n64_host.c. Then checks the save survives a power cut while the
+// next one is being written.
+//   make EP=4 TARGET=linux sram_bench
+//   ./build-linux/sram_bench [save bytes]
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SAVE_BYTES (32 * 1024) //Big enough to cross the first 32kB bank
+
+typedef struct
+{
+    const char *name;
+    uint32_t size;
+    uint32_t offset;
+} sram_files_t;
+int sramfs_init(sram_files_t *files, int num_files);
+
+typedef struct
+{
+    uint32_t total;
+    uint32_t allocated;
+    uint32_t capacity;
+    uint32_t used;
+} sramfs_usage_t;
+void sramfs_get_usage(sramfs_usage_t *usage);
+void host_pi_get_stats(long long *transfers, long long *bytes, long long *ns);
+void host_sram_cut_power_after(long long bytes);
+
+//Same layout as n64_main.c with one save slot
+static sram_files_t bench_files[] = {
+    {"OMNISPK.CFG", 4096, 0},
+    {"SAVEGAM0.CK4", 0, 0},
+};
+
+static long long last_transfers, last_bytes, last_ns;
+
+static void report(const char *step)
+{
+    long long transfers, bytes, ns;
+    host_pi_get_stats(&transfers, &bytes, &ns);
+    printf("%-7s %7lld transfers %8lld bytes %9.2fms\n", step, transfers - last_transfers, bytes - last_bytes,
+           (ns - last_ns) / 1e6);
+    last_transfers = transfers;
+    last_bytes = bytes;
+    last_ns = ns;
+}
+
+//The engine saves field by field, mostly 16-bit values with the occasional larger block
+static int piece_size(uint32_t *seed)
+{
+    static const int sizes[] = {2, 2, 2, 2, 4, 4, 1, 8, 2, 64, 2, 300};
+    *seed = *seed * 1103515245 + 12345;
+    return sizes[(*seed >> 16) % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static bool save_file(const uint8_t *data, int bytes)
+{
+    FILE *f = fopen("sram:/SAVEGAM0.CK4", "wb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    uint32_t seed = 1;
+    for (int pos = 0; pos < bytes;)
+    {
+        int n = piece_size(&seed);
+        n = (n < bytes - pos) ? n : bytes - pos;
+        fwrite(&data[pos], 1, n, f);
+        pos += n;
+    }
+    fclose(f);
+    return true;
+}
+
+//Returns how many of the bytes matched
+static int load_file(const uint8_t *expected, int bytes)
+{
+    FILE *f = fopen("sram:/SAVEGAM0.CK4", "rb");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    uint8_t *data = calloc(bytes, 1);
+    uint32_t seed = 1;
+    for (int pos = 0; pos < bytes;)
+    {
+        int n = piece_size(&seed);
+        n = (n < bytes - pos) ? n : bytes - pos;
+        if (fread(&data[pos], 1, n, f) != (size_t)n)
+        {
+            break;
+        }
+        pos += n;
+    }
+    fclose(f);
+
+    int same = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        same += (data[i] == expected[i]);
+    }
+    free(data);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    int save_bytes = (argc > 1) ? atoi(argv[1]) : BENCH_SAVE_BYTES;
+    uint8_t *first = malloc(save_bytes);
+    uint8_t *second = malloc(save_bytes);
+    for (int i = 0; i < save_bytes; i++)
+    {
+        first[i] = (uint8_t)(i * 7 + (i >> 8));
+        second[i] = (uint8_t)~first[i];
+    }
+
+    sramfs_init(bench_files, sizeof(bench_files) / sizeof(bench_files[0]));
+    report("init");
+
+    if (!save_file(first, save_bytes))
+    {
+        fprintf(stderr, "sram_bench: can't create the save\n");
+        return 1;
+    }
+    report("save");
+    int loaded = load_file(first, save_bytes);
+    report("load");
+    printf("%d bytes saved, %d match when loaded\n", save_bytes, loaded);
+
+    //Overwrite it, losing power halfway through the commit. The first save should still load.
+    host_sram_cut_power_after(save_bytes / 2);
+    save_file(second, save_bytes);
+    host_sram_cut_power_after(-1);
+    int kept = load_file(first, save_bytes);
+    printf("power cut during the next save: %d bytes of the previous save match\n", kept);
+
+    sramfs_usage_t usage;
+    sramfs_get_usage(&usage);
+    printf("%u of %u bytes of file space used, %u of %u bytes of SRAM allocated\n", usage.used, usage.capacity,
+           usage.allocated, usage.total);
+
+    return (loaded != save_bytes || kept != save_bytes);
+}
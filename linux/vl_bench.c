@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Host benchmark for the 64-bit drawing kernels in id_vl_n64_swar.c. Runs each one against the generic
+// VL_*ToPAL8 converter in id_vl.c it replaces, on the same random data, and reports how many pixels differ
+// and millions of pixels per second for each. The map mask fill has no generic converter, so it's checked
+// against the loop VL_N64_SurfaceRect_PM had. The timings are of the build machine, so only the ratio
+// between the two says anything about the N64.
+// VL_N64_PlanarToPAL8, the C version of the RSP planar conversion in rsp_planar.S, is checked the same way
+// against VL_UnmaskedToPAL8 and VL_MaskedToPAL8. Any difference makes the exit status non-zero. It links
+// against the rest of the host build for id_vl.c.
+//   make EP=4 TARGET=linux vl_bench
+//   ./build-linux/vl_bench [seed]
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "id_vl_private.h"
+#include "id_vl_n64_private.h"
+
+#define BENCH_W 336 //Same as the front buffer, which has a tile of margin either side
+#define BENCH_H 224
+#define BENCH_CHECKS 20000
+#define BENCH_PIXELS (64 * 1024 * 1024) //Drawn by each timed case
+
+static uint8_t src_bits[BENCH_W / 8 * BENCH_H * 5];
+static uint8_t dst_ref[BENCH_W * BENCH_H];
+static uint8_t dst_swar[BENCH_W * BENCH_H];
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//How VL_N64_SurfaceRect_PM filled before
+static void ref_rect_pm(uint8_t *dest, int pitch, int w, int h, int colour, int mapmask)
+{
+    colour &= mapmask;
+    for (int y = 0; y < h; y++)
+    {
+        uint8_t *p = dest + y * pitch;
+        for (int x = 0; x < w; x++, p++)
+        {
+            *p &= ~mapmask;
+            *p |= colour;
+        }
+    }
+}
+
+//The generic converter for each 1bpp draw, rows start on a byte
+static void ref_1bpp(const uint8_t *src, uint8_t *dest, int pitch, int w, int h, int colour, int mapmask, bool xor)
+{
+    if (xor)
+        VL_1bppXorWithPAL8((void *)src, dest, 0, 0, pitch, w, h, colour);
+    else if (mapmask == 0xFF)
+        VL_1bppToPAL8((void *)src, dest, 0, 0, pitch, w, h, colour);
+    else
+        VL_1bppToPAL8_PM((void *)src, dest, 0, 0, pitch, w, h, colour, mapmask);
+}
+
+static void swar_1bpp(const uint8_t *src, uint8_t *dest, int pitch, int w, int h, int colour, int mapmask, bool xor)
+{
+    if (xor)
+        VL_N64_1bppXorWithPAL8(src, 0, (w + 7) / 8 * 8, dest, pitch, w, h, colour);
+    else
+        VL_N64_1bppToPAL8_PM(src, 0, (w + 7) / 8 * 8, dest, pitch, w, h, colour, mapmask);
+}
+
+//VL_UnmaskedToPAL8, or VL_MaskedToPAL8 into a cleared buffer. The mask VL_N64_PlanarToPAL8 gives has a bit set
+//for each pixel the masked converter leaves alone, which shows up when it's run again over a background
+//outside the 16 colours.
+static void ref_planar(const uint8_t *src, int w, int h, uint8_t *pixels, uint8_t *mask)
+{
+    static uint8_t keep[BENCH_W * BENCH_H];
+    if (!mask)
+    {
+        VL_UnmaskedToPAL8((void *)src, pixels, 0, 0, w, w, h);
+        return;
+    }
+    memset(pixels, 0x00, w * h);
+    VL_MaskedToPAL8((void *)src, pixels, 0, 0, w, w, h);
+    memset(keep, 0xF0, w * h);
+    VL_MaskedToPAL8((void *)src, keep, 0, 0, w, w, h);
+    memset(mask, 0, w * h / 8);
+    for (int i = 0; i < w * h; i++)
+    {
+        if (keep[i] != pixels[i])
+            mask[i / 8] |= 0x80 >> (i & 7);
+    }
+}
+
+typedef enum
+{
+    OP_RECT_PM,
+    OP_1BPP,
+    OP_1BPP_PM,
+    OP_1BPP_XOR,
+    OP_COUNT
+} bench_op_t;
+
+static const char *op_names[OP_COUNT] = {"rect_pm", "1bpp", "1bpp_pm", "1bpp_xor"};
+
+static void run(bench_op_t op, bool swar, uint8_t *dest, int x, int y, int w, int h, int colour, int mapmask)
+{
+    uint8_t *d = dest + y * BENCH_W + x;
+    switch (op)
+    {
+        case OP_RECT_PM:
+            if (swar)
+                VL_N64_RectToPAL8_PM(d, BENCH_W, w, h, colour, mapmask);
+            else
+                ref_rect_pm(d, BENCH_W, w, h, colour, mapmask);
+            break;
+        case OP_1BPP:
+        case OP_1BPP_PM:
+        case OP_1BPP_XOR:
+            if (op == OP_1BPP)
+                mapmask = 0xFF;
+            (swar ? swar_1bpp : ref_1bpp)(src_bits, d, BENCH_W, w, h, colour, mapmask, op == OP_1BPP_XOR);
+            break;
+        default:
+            break;
+    }
+}
+
+//Random sizes and positions, including rows that aren't a whole number of bytes or 64-bit words
+static int check(bench_op_t op)
+{
+    int bad = 0;
+    for (int i = 0; i < BENCH_CHECKS; i++)
+    {
+        int w = 1 + rand() % 64, h = 1 + rand() % 32;
+        int x = rand() % (BENCH_W - w), y = rand() % (BENCH_H - h);
+        int colour = rand() % 16, mapmask = rand() % 16;
+        run(op, false, dst_ref, x, y, w, h, colour, mapmask);
+        run(op, true, dst_swar, x, y, w, h, colour, mapmask);
+    }
+    for (int i = 0; i < BENCH_W * BENCH_H; i++)
+        bad += (dst_ref[i] != dst_swar[i]);
+    return bad;
+}
+
+static int check_planar(bool masked)
+{
+    int bad = 0;
+    for (int i = 0; i < BENCH_CHECKS / 10; i++)
+    {
+        int w = 8 * (1 + rand() % 8), h = 1 + rand() % 48;
+        uint8_t mask_ref[BENCH_W / 8 * BENCH_H], mask_c[BENCH_W / 8 * BENCH_H];
+        ref_planar(src_bits, w, h, dst_ref, masked ? mask_ref : NULL);
+        VL_N64_PlanarToPAL8(src_bits, w / 8 * h, dst_swar, masked ? mask_c : NULL);
+        for (int j = 0; j < w * h; j++)
+            bad += (dst_ref[j] != dst_swar[j]) || (masked && ((mask_ref[j / 8] ^ mask_c[j / 8]) & (0x80 >> (j & 7))));
+        src_bits[rand() % sizeof(src_bits)] = rand();
+    }
+    return bad;
+}
+
+static double throughput_planar(bool masked, bool c, int w, int h)
+{
+    static uint8_t mask[BENCH_W / 8 * BENCH_H];
+    long count = BENCH_PIXELS / (w * h);
+    double start = now_seconds();
+    for (long i = 0; i < count; i++)
+    {
+        if (c)
+            VL_N64_PlanarToPAL8(src_bits, w / 8 * h, dst_swar, masked ? mask : NULL);
+        else if (masked)
+            VL_MaskedToPAL8(src_bits, dst_ref, 0, 0, w, w, h);
+        else
+            VL_UnmaskedToPAL8(src_bits, dst_ref, 0, 0, w, w, h);
+    }
+    return count * w * h / (now_seconds() - start) / 1e6;
+}
+
+//Mpixels/s drawing w x h repeatedly across the buffer
+static double throughput(bench_op_t op, bool swar, int w, int h)
+{
+    long count = BENCH_PIXELS / (w * h);
+    double start = now_seconds();
+    for (long i = 0; i < count; i++)
+    {
+        int x = (i * 8) % (BENCH_W - w), y = (i * 3) % (BENCH_H - h);
+        run(op, swar, swar ? dst_swar : dst_ref, x, y, w, h, i & 15, 0x5);
+    }
+    return count * w * h / (now_seconds() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for (size_t i = 0; i < sizeof(src_bits); i++)
+        src_bits[i] = rand();
+    for (int i = 0; i < BENCH_W * BENCH_H; i++)
+        dst_ref[i] = dst_swar[i] = rand() & 15;
+
+    //Font glyphs and status text are small, bars and screen clears are wide
+    static const int sizes[][2] = {{8, 10}, {16, 16}, {320, 200}};
+    int failed = 0;
+    printf("%-9s %7s %11s %18s %18s\n", "kernel", "bad px", "size", "generic Mpx/s", "64-bit Mpx/s");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        int bad = check(op);
+        failed |= (bad != 0);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            int w = sizes[s][0], h = sizes[s][1];
+            double ref = throughput(op, false, w, h);
+            double swar = throughput(op, true, w, h);
+            printf("%-9s %7d %5dx%-5d %18.1f %12.1f %4.1fx\n", op_names[op], bad, w, h, ref, swar, swar / ref);
+        }
+    }
+
+    printf("\n%-9s %7s %11s %18s %18s\n", "planar", "bad px", "size", "generic Mpx/s", "RSP model Mpx/s");
+    for (int masked = 0; masked < 2; masked++)
+    {
+        int bad = check_planar(masked);
+        failed |= (bad != 0);
+        for (size_t s = 1; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            int w = sizes[s][0], h = sizes[s][1];
+            double ref = throughput_planar(masked, false, w, h);
+            double c = throughput_planar(masked, true, w, h);
+            printf("%-9s %7d %5dx%-5d %18.1f %12.1f %4.1fx\n", masked ? "masked" : "unmasked", bad, w, h, ref, c,
+                   c / ref);
+        }
+    }
+    return failed;
+}
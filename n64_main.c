@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <libdragon.h>
 #include "id_ca.h"
 #include "id_fs.h"
@@ -28,29 +29,39 @@ typedef struct sram_files_t
     uint32_t offset; //Track position of the file cursor
 } sram_files_t;
 int sramfs_init(sram_files_t *files, int num_files);
+int romfs_init(void);
 
-#define MAX_SRAM_FILES 2
+//OMNISPK.CFG followed by SAVEGAM0 to SAVEGAMn, which split the rest of the SRAM between them
+#ifndef N64_SAVE_SLOTS
+#define N64_SAVE_SLOTS 1
+#endif
+#if N64_SAVE_SLOTS < 1 || N64_SAVE_SLOTS > 6
+#error N64_SAVE_SLOTS must be 1 to 6, the number of save games the menu has
+#endif
+
+#define MAX_SRAM_FILES (1 + N64_SAVE_SLOTS)
 #ifdef EP4
-static sram_files_t sram_files[MAX_SRAM_FILES] = {
-    {"OMNISPK.CFG", 2048, 0},
-    {"SAVEGAM0.CK4", 131072 - 2048, 0},
-};
+#define SAVE_EXT "CK4"
 #elif EP5
-static sram_files_t sram_files[MAX_SRAM_FILES] = {
-    {"OMNISPK.CFG", 2048, 0},
-    {"SAVEGAM0.CK5", 131072 - 2048, 0},
-};
+#define SAVE_EXT "CK5"
 #elif EP6
+#define SAVE_EXT "CK6"
+#endif
+static char sram_save_names[N64_SAVE_SLOTS][16];
 static sram_files_t sram_files[MAX_SRAM_FILES] = {
-    {"OMNISPK.CFG", 2048, 0},
-    {"SAVEGAM0.CK6", 131072 - 2048, 0},
+    {"OMNISPK.CFG", 4096, 0},
 };
-#endif
 
 int main(void)
 {
     debug_init(DEBUG_FEATURE_LOG_ISVIEWER);
     dfs_init(DFS_DEFAULT_LOCATION);
+    romfs_init();
+    for (int i = 0; i < N64_SAVE_SLOTS; i++)
+    {
+        snprintf(sram_save_names[i], sizeof(sram_save_names[i]), "SAVEGAM%d." SAVE_EXT, i);
+        sram_files[1 + i] = (sram_files_t){sram_save_names[i], 0, 0};
+    }
     sramfs_init(sram_files, MAX_SRAM_FILES);
     timer_init();
 
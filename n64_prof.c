@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifdef N64_PROFILE
+
+#include <stdio.h>
+#include <string.h>
+#include <libdragon.h>
+#include "n64_prof.h"
+
+#define N64_PROF_MAX_DEPTH 8
+#define N64_PROF_TRACE_MAGIC 0x4F535046 //'OSPF'
+#define N64_PROF_TRACE_VERSION 1
+
+//Overlay scale: one full 60Hz frame budget is drawn this many pixels high
+#define N64_PROF_BAR_HEIGHT 32
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t num_slots;
+    uint8_t num_frames;
+    uint32_t ticks_per_second;
+    uint32_t sequence;
+} N64_ProfTraceHeader;
+
+static N64_ProfFrame prof_ring[N64_PROF_RING_FRAMES];
+static N64_ProfFrame prof_current;
+static int prof_ring_pos = 0;
+static uint32_t prof_sequence = 0;
+
+static uint8_t prof_stack[N64_PROF_MAX_DEPTH];
+static int prof_depth = 0;
+static long long prof_mark = 0;
+static long long prof_frame_start = 0;
+
+static const color_t prof_colours[N64_PROF_NUM_SLOTS] = {
+    [N64_PROF_RECT] = RGBA32(0, 0, 255, 255),
+    [N64_PROF_BLIT] = RGBA32(0, 255, 0, 255),
+    [N64_PROF_MASKED_BLIT] = RGBA32(255, 255, 0, 255),
+    [N64_PROF_SCROLL] = RGBA32(255, 0, 255, 255),
+    [N64_PROF_PRESENT] = RGBA32(255, 0, 0, 255),
+    [N64_PROF_AUDIO] = RGBA32(0, 255, 255, 255),
+};
+
+void N64_ProfPush(N64_ProfSlot slot)
+{
+    long long now = timer_ticks();
+    if (prof_depth > 0)
+    {
+        prof_current.ticks[prof_stack[prof_depth - 1]] += (uint32_t)(now - prof_mark);
+    }
+    assert(prof_depth < N64_PROF_MAX_DEPTH);
+    prof_stack[prof_depth++] = slot;
+    prof_current.calls[slot]++;
+    prof_mark = now;
+}
+
+void N64_ProfPop(void)
+{
+    long long now = timer_ticks();
+    assert(prof_depth > 0);
+    prof_current.ticks[prof_stack[--prof_depth]] += (uint32_t)(now - prof_mark);
+    prof_mark = now;
+}
+
+static void prof_dump_trace(void)
+{
+    N64_ProfTraceHeader hdr = {
+        .magic = N64_PROF_TRACE_MAGIC,
+        .version = N64_PROF_TRACE_VERSION,
+        .num_slots = N64_PROF_NUM_SLOTS,
+        .num_frames = N64_PROF_RING_FRAMES,
+        .ticks_per_second = TICKS_PER_SECOND,
+        .sequence = prof_sequence++
+    };
+    //stderr is routed to the ISViewer by debug_init()
+    fwrite(&hdr, sizeof(hdr), 1, stderr);
+    fwrite(prof_ring, sizeof(prof_ring), 1, stderr);
+    fflush(stderr);
+}
+
+void N64_ProfFrameEnd(void)
+{
+    long long now = timer_ticks();
+    if (prof_frame_start != 0)
+    {
+        prof_current.frame_ticks = (uint32_t)(now - prof_frame_start);
+    }
+    prof_frame_start = now;
+
+    prof_ring[prof_ring_pos] = prof_current;
+    memset(&prof_current, 0, sizeof(prof_current));
+    if (++prof_ring_pos == N64_PROF_RING_FRAMES)
+    {
+        prof_ring_pos = 0;
+        prof_dump_trace();
+    }
+}
+
+//Draws one stacked column per recorded frame, oldest on the left, with a line marking the 60Hz budget.
+//Must be called while rdpq is attached to the display surface.
+void N64_ProfDrawOverlay(int x, int y)
+{
+    const uint32_t budget = TICKS_PER_SECOND / 60;
+    const int bottom = y + N64_PROF_BAR_HEIGHT * 2;
+
+    rdpq_set_mode_fill(RGBA32(0, 0, 0, 255));
+    rdpq_fill_rectangle(x, y, x + N64_PROF_RING_FRAMES, bottom);
+
+    for (int i = 0; i < N64_PROF_RING_FRAMES; i++)
+    {
+        const N64_ProfFrame *f = &prof_ring[(prof_ring_pos + i) % N64_PROF_RING_FRAMES];
+        int top = bottom;
+        for (int s = 0; s < N64_PROF_NUM_SLOTS; s++)
+        {
+            int h = (int)((uint64_t)f->ticks[s] * N64_PROF_BAR_HEIGHT / budget);
+            h = h > top - y ? top - y : h;
+            if (h <= 0)
+            {
+                continue;
+            }
+            rdpq_set_fill_color(prof_colours[s]);
+            rdpq_fill_rectangle(x + i, top - h, x + i + 1, top);
+            top -= h;
+        }
+    }
+
+    rdpq_set_fill_color(RGBA32(255, 255, 255, 255));
+    rdpq_fill_rectangle(x, bottom - N64_PROF_BAR_HEIGHT, x + N64_PROF_RING_FRAMES, bottom - N64_PROF_BAR_HEIGHT + 1);
+}
+
+#endif
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// Per-frame profiler for the N64 backends. Build with `make PROFILE=1` to enable, otherwise
+// every macro below expands to nothing and n64_prof.c compiles to an empty object.
+//
+// Time is charged exclusively: when a profiled call nests another the inner time is not counted
+// against the outer slot. Only the main thread is profiled; the OPL synthesis in the t0 timer
+// interrupt shows up as time taken from whatever it interrupted.
+
+#ifndef __N64_PROF_H__
+#define __N64_PROF_H__
+
+#include <stdint.h>
+
+typedef enum
+{
+    N64_PROF_RECT,
+    N64_PROF_BLIT,
+    N64_PROF_MASKED_BLIT,
+    N64_PROF_SCROLL,
+    N64_PROF_PRESENT,
+    N64_PROF_AUDIO,
+    N64_PROF_NUM_SLOTS
+} N64_ProfSlot;
+
+//Number of frames kept in the ring buffer. The whole ring is dumped over ISViewer each time it wraps.
+#define N64_PROF_RING_FRAMES 64
+
+typedef struct
+{
+    uint32_t frame_ticks;
+    uint32_t ticks[N64_PROF_NUM_SLOTS];
+    uint16_t calls[N64_PROF_NUM_SLOTS];
+} N64_ProfFrame;
+
+#ifdef N64_PROFILE
+void N64_ProfPush(N64_ProfSlot slot);
+void N64_ProfPop(void);
+void N64_ProfFrameEnd(void);
+void N64_ProfDrawOverlay(int x, int y);
+#define N64_PROF_BEGIN(slot) N64_ProfPush(slot)
+#define N64_PROF_END() N64_ProfPop()
+#define N64_PROF_FRAME_END() N64_ProfFrameEnd()
+#define N64_PROF_DRAW_OVERLAY(x, y) N64_ProfDrawOverlay(x, y)
+#else
+#define N64_PROF_BEGIN(slot)
+#define N64_PROF_END()
+#define N64_PROF_FRAME_END()
+#define N64_PROF_DRAW_OVERLAY(x, y)
+#endif
+
+#endif